@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""
+Compares incoming command throughput (messages/sec) between the default per-message gil
+acquisition and a BatchDispatcher.
+
+    python3 bench/batch_dispatch.py [--messages N] [--threads N] [--max-batch N]
+"""
+
+from oxenmq import OxenMQ, AuthLevel, Address
+import argparse
+import os
+import tempfile
+import threading
+import time
+
+
+def run(args, batched):
+    sock = os.path.join(tempfile.mkdtemp(), 'bench.sock')
+    server = OxenMQ()
+    server.set_general_threads(args.threads)
+    addr = Address('ipc://' + sock, server.pubkey)
+    server.listen(addr.zmq_address, curve=True)
+
+    done = threading.Event()
+    lock = threading.Lock()
+    count = 0
+
+    def handler(m):
+        nonlocal count
+        with lock:
+            count += 1
+            if count == args.messages:
+                done.set()
+
+    dispatcher = server.add_batch_dispatcher(max_batch=args.max_batch) if batched else None
+    server.add_category('bench', AuthLevel.none).add_command('cmd', handler, dispatcher=dispatcher)
+    server.start()
+
+    client = OxenMQ()
+    client.start()
+    conn = client.connect_remote(addr)
+
+    start = time.perf_counter()
+    payload = b'x' * args.size
+    for _ in range(args.messages):
+        client.send(conn, 'bench.cmd', payload)
+    if not done.wait(60):
+        raise RuntimeError(f"only {count} of {args.messages} messages received")
+    elapsed = time.perf_counter() - start
+
+    os.remove(sock)
+    return args.messages / elapsed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--messages", type=int, default=100000, help="messages to send per run")
+    ap.add_argument("--threads", type=int, default=os.cpu_count(), help="server general threads")
+    ap.add_argument("--max-batch", type=int, default=64, help="BatchDispatcher max_batch")
+    ap.add_argument("--size", type=int, default=16, help="message payload size")
+    args = ap.parse_args()
+
+    direct = run(args, False)
+    print(f"per-message gil: {direct:12.0f} msg/s")
+    batched = run(args, True)
+    print(f"batched dispatch: {batched:12.0f} msg/s ({batched / direct:.2f}x)")
+
+
+if __name__ == '__main__':
+    main()
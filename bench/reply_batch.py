@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+Compares deferred reply throughput (replies/sec) between replying to each DeferredSend individually
+and flushing them together through a ReplyBatch.
+
+    python3 bench/reply_batch.py [--requests N] [--group N] [--size N]
+"""
+
+from oxenmq import OxenMQ, AuthLevel, Address, ReplyBatch
+import argparse
+import os
+import tempfile
+import threading
+import time
+
+
+def run(args, batched):
+    sock = os.path.join(tempfile.mkdtemp(), 'bench.sock')
+    server = OxenMQ()
+    addr = Address('ipc://' + sock, server.pubkey)
+    server.listen(addr.zmq_address, curve=True)
+
+    payload = b'x' * args.size
+    lock = threading.Lock()
+    pending = []
+
+    # Defers each request, then completes them `group` at a time, as a handler waiting on a backend
+    # query would.
+    def handler(m):
+        with lock:
+            pending.append(m.later())
+            if len(pending) < args.group:
+                return
+            group = pending[:]
+            pending.clear()
+        if batched:
+            batch = ReplyBatch()
+            for d in group:
+                batch.add(d, payload)
+            batch.flush()
+        else:
+            for d in group:
+                d.reply(payload)
+
+    server.add_category('bench', AuthLevel.none).add_request_command('req', handler)
+    server.start()
+
+    client = OxenMQ()
+    client.start()
+    conn = client.connect_remote(addr)
+
+    done = threading.Event()
+    count = 0
+
+    def on_reply(r):
+        nonlocal count
+        with lock:
+            count += 1
+            if count == args.requests:
+                done.set()
+
+    start = time.perf_counter()
+    for _ in range(args.requests):
+        client.request(conn, 'bench.req', on_reply=on_reply)
+    if not done.wait(60):
+        raise RuntimeError(f"only {count} of {args.requests} replies received")
+    elapsed = time.perf_counter() - start
+
+    os.remove(sock)
+    return args.requests / elapsed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--requests", type=int, default=100000, help="requests to send per run")
+    ap.add_argument("--group", type=int, default=200, help="deferred replies completed together")
+    ap.add_argument("--size", type=int, default=16, help="reply payload size")
+    args = ap.parse_args()
+    if args.requests % args.group:
+        ap.error("--requests must be a multiple of --group")
+
+    single = run(args, False)
+    print(f"per-reply:     {single:12.0f} replies/s")
+    batched = run(args, True)
+    print(f"batched flush: {batched:12.0f} replies/s ({batched / single:.2f}x)")
+
+
+if __name__ == '__main__':
+    main()
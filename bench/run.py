@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""
+Benchmarks the hot paths of the python binding: throughput and p50/p99 latency for commands,
+requests (callback and future), large payloads, Message.dataview() vs Message.data(), and requests
+spread over many connections, over `ipc://` sockets and/or `inproc` connections.
+
+    python3 bench/run.py [--transport ipc|inproc|both] [--scale X] [--only NAME ...]
+                         [--output results.jsonl] [--compare results.jsonl [--threshold PCT]]
+
+--output appends a JSON record of the run (with the git commit, python version and time) to the
+given file so that results can be tracked over time; --compare reports the change of each result
+relative to the most recent record for the same transport in the given file, exiting with status 1
+if any throughput dropped by more than --threshold percent.
+"""
+
+from oxenmq import OxenMQ, AuthLevel, Address
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+class Harness:
+    """A server with the benchmark commands plus a way to make client connections to it, either
+    from a second OxenMQ over an ipc socket, or from the server itself over inproc."""
+
+    def __init__(self, transport, handlers):
+        self.transport = transport
+        self.server = OxenMQ()
+        if transport == 'ipc':
+            self.sockdir = tempfile.mkdtemp()
+            self.addr = Address('ipc://' + os.path.join(self.sockdir, 'bench.sock'), self.server.pubkey)
+            self.server.listen(self.addr.zmq_address, curve=True)
+        # Unbounded queue: oxenmq otherwise drops commands beyond the default 200 queued, which the
+        # unthrottled benchmarks easily exceed
+        cat = self.server.add_category('bench', AuthLevel.none, max_queue=-1)
+        for name, (handler, request) in handlers.items():
+            (cat.add_request_command if request else cat.add_command)(name, handler)
+        self.server.start()
+
+        if transport == 'ipc':
+            self.client = OxenMQ()
+            self.client.start()
+        else:
+            self.client = self.server
+
+    def connect(self):
+        if self.transport == 'ipc':
+            return self.client.connect_remote(self.addr)
+        return self.client.connect_inproc(on_success=lambda c: None, on_failure=lambda c, e: None)
+
+    def close(self):
+        del self.client, self.server
+        if self.transport == 'ipc':
+            os.remove(self.addr.zmq_address[len('ipc://'):])
+            os.rmdir(self.sockdir)
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(p * len(sorted_values)))]
+
+
+def result(ops, elapsed, latencies=None, nbytes=None):
+    r = {'ops': ops, 'seconds': round(elapsed, 6), 'ops_per_sec': round(ops / elapsed, 1)}
+    if latencies:
+        latencies.sort()
+        r['p50_us'] = round(percentile(latencies, 0.50) * 1e6, 1)
+        r['p99_us'] = round(percentile(latencies, 0.99) * 1e6, 1)
+    if nbytes is not None:
+        r['mb_per_sec'] = round(nbytes / elapsed / 1e6, 1)
+    return r
+
+
+class Counter:
+    """Counts events from OxenMQ threads, signalling once `target` is reached."""
+
+    def __init__(self, target):
+        self.target = target
+        self.count = 0
+        self.lock = threading.Lock()
+        self.done = threading.Event()
+
+    def __call__(self, *args):
+        with self.lock:
+            self.count += 1
+            if self.count == self.target:
+                self.done.set()
+
+    def wait(self):
+        if not self.done.wait(120):
+            raise RuntimeError(f"timed out after {self.count} of {self.target}")
+
+
+def send_commands(transport, n, size=16, handler=None, parts=1):
+    """Sends n commands of `parts` parts of `size` bytes each; returns the elapsed time."""
+    counter = Counter(n)
+
+    def handle(m):
+        if handler:
+            handler(m)
+        counter()
+
+    h = Harness(transport, {'cmd': (handle, False)})
+    try:
+        conn = h.connect()
+        payload = [b'x' * size] * parts
+        start = time.perf_counter()
+        for _ in range(n):
+            h.client.send(conn, 'bench.cmd', *payload)
+        counter.wait()
+        return time.perf_counter() - start
+    finally:
+        h.close()
+
+
+def bench_command(transport, scale):
+    n = int(100000 * scale)
+    return result(n, send_commands(transport, n))
+
+
+def bench_large_payload(transport, scale):
+    n, size = int(200 * scale) or 1, 1 << 20
+    return result(n, send_commands(transport, n, size=size), nbytes=n * size)
+
+
+def bench_dataview(transport, scale):
+    n = int(50000 * scale)
+    return result(n, send_commands(transport, n, size=64, parts=8, handler=lambda m: m.dataview()))
+
+
+def bench_data(transport, scale):
+    n = int(50000 * scale)
+    return result(n, send_commands(transport, n, size=64, parts=8, handler=lambda m: m.data()))
+
+
+def request_callbacks(h, conns, n, window=256):
+    """Issues n requests round-robin over `conns` with at most `window` in flight, returning the
+    elapsed time, per-request latencies of the successful requests, and the number of failures."""
+    latencies = []
+    failures = Counter(n)
+    counter = Counter(n)
+    credits = threading.Semaphore(window)
+
+    def on_reply(sent):
+        def f(r):
+            latencies.append(time.perf_counter() - sent)
+            credits.release()
+            counter()
+        return f
+
+    def on_failure(r):
+        failures()
+        credits.release()
+        counter()
+
+    start = time.perf_counter()
+    for i in range(n):
+        credits.acquire()
+        h.client.request(conns[i % len(conns)], 'bench.echo', b'ping', on_reply=on_reply(time.perf_counter()),
+                         on_reply_failure=on_failure)
+    counter.wait()
+    return time.perf_counter() - start, latencies, failures.count
+
+
+def request_result(n, elapsed, latencies, failures):
+    r = result(n, elapsed, latencies)
+    if failures:
+        r['failures'] = failures
+    return r
+
+
+def bench_request_callback(transport, scale):
+    n = int(50000 * scale)
+    h = Harness(transport, {'echo': (lambda m: m.dataview(), True)})
+    try:
+        return request_result(n, *request_callbacks(h, [h.connect()], n))
+    finally:
+        h.close()
+
+
+def bench_request_future(transport, scale):
+    n = int(10000 * scale)
+    h = Harness(transport, {'echo': (lambda m: m.dataview(), True)})
+    try:
+        conn = h.connect()
+        latencies = []
+        start = time.perf_counter()
+        for _ in range(n):
+            sent = time.perf_counter()
+            h.client.request_future(conn, 'bench.echo', b'ping').get()
+            latencies.append(time.perf_counter() - sent)
+        return result(n, time.perf_counter() - start, latencies)
+    finally:
+        h.close()
+
+
+def bench_many_connections(transport, scale):
+    n, nconns = int(50000 * scale), 64
+    h = Harness(transport, {'echo': (lambda m: m.dataview(), True)})
+    try:
+        conns = [h.connect() for _ in range(nconns)]
+        r = request_result(n, *request_callbacks(h, conns, n))
+        r['connections'] = nconns
+        return r
+    finally:
+        h.close()
+
+
+BENCHMARKS = {
+    'command': bench_command,
+    'request_callback': bench_request_callback,
+    'request_future': bench_request_future,
+    'large_payload': bench_large_payload,
+    'dataview': bench_dataview,
+    'data': bench_data,
+    'many_connections': bench_many_connections,
+}
+
+
+def git_commit():
+    try:
+        return subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__)), check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def load_baseline(path, transport):
+    baseline = None
+    with open(path) as f:
+        for line in f:
+            if line.strip():
+                record = json.loads(line)
+                if record['transport'] == transport:
+                    baseline = record
+    return baseline
+
+
+def compare(results, baseline, threshold):
+    """Prints the change of each result against the baseline; returns the regressed benchmarks."""
+    regressed = []
+    for name, r in results.items():
+        old = baseline['results'].get(name)
+        if not old:
+            continue
+        change = (r['ops_per_sec'] / old['ops_per_sec'] - 1) * 100
+        line = f"  {name:18} {change:+7.1f}% ops/s"
+        if 'p99_us' in r and 'p99_us' in old:
+            line += f"  p99 {old['p99_us']:9.1f}us -> {r['p99_us']:9.1f}us"
+        if change < -threshold:
+            line += "  REGRESSION"
+            regressed.append(name)
+        print(line)
+    return regressed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--transport", choices=('ipc', 'inproc', 'both'), default='both')
+    ap.add_argument("--scale", type=float, default=1.0, help="multiplier for the operation counts")
+    ap.add_argument("--only", nargs='+', choices=BENCHMARKS.keys(), help="run only these benchmarks")
+    ap.add_argument("--output", help="append results to this JSON lines file")
+    ap.add_argument("--compare", help="compare against the latest matching record in this file")
+    ap.add_argument("--threshold", type=float, default=10.0, help="regression threshold, in percent")
+    args = ap.parse_args()
+
+    transports = ('ipc', 'inproc') if args.transport == 'both' else (args.transport,)
+    names = args.only or list(BENCHMARKS)
+    regressed = []
+    for transport in transports:
+        print(f"{transport}:")
+        results = {}
+        for name in names:
+            r = results[name] = BENCHMARKS[name](transport, args.scale)
+            line = f"  {name:18} {r['ops_per_sec']:12.0f} ops/s"
+            if 'p50_us' in r:
+                line += f"  p50 {r['p50_us']:9.1f}us  p99 {r['p99_us']:9.1f}us"
+            if 'mb_per_sec' in r:
+                line += f"  {r['mb_per_sec']:9.1f} MB/s"
+            print(line)
+
+        if args.compare:
+            baseline = load_baseline(args.compare, transport)
+            if baseline:
+                print(f"  compared to {baseline.get('commit') or 'unknown commit'} ({baseline['time']}):")
+                regressed += [f"{transport}/{n}" for n in compare(results, baseline, args.threshold)]
+
+        if args.output:
+            record = {
+                'time': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+                'commit': git_commit(),
+                'python': platform.python_version(),
+                'transport': transport,
+                'scale': args.scale,
+                'results': results,
+            }
+            with open(args.output, 'a') as f:
+                f.write(json.dumps(record) + '\n')
+
+    if regressed:
+        print("regressions: " + ", ".join(regressed))
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -13,7 +13,7 @@ ext_modules = [Pybind11Extension(
         "oxenmq",
         ["src/oxenmq.cpp"],
         cxx_std=17,
-        libraries=["oxenmq"],
+        libraries=["oxenmq", "zstd", "lz4"],
         ),
 ]
 
@@ -1,7 +1,14 @@
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
 #include <oxenmq/oxenmq.h>
 #include <oxenmq/address.h>
+#include <oxenmq/batch.h>
+#include <oxenmq/bt_serialize.h>
 #include <pybind11/attr.h>
 #include <pybind11/chrono.h>
 #include <pybind11/functional.h>
@@ -10,49 +17,3214 @@
 #include <pybind11/pytypes.h>
 #include <pybind11/stl.h>
 #include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <variant>
+#include <fcntl.h>
+#include <lz4.h>
+#include <unistd.h>
+#include <zstd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 namespace py = pybind11;
 
 namespace oxenmq {
 
-// Convert a py::object containing a str, bytes, or iterable over str/bytes to a vector of message
-// parts.  Throws on invalid input, otherwise returns a vector of parts.
+// Holds the message parts of a py::object containing a str, bytes, any other object supporting the
+// contiguous buffer protocol (bytearray, memoryview, mmap, numpy arrays, ...), or an iterable over
+// such values, as string_views pointing directly into the python objects' memory.  Nothing is
+// copied: instead this object holds references to (and buffer locks on) the source objects, and so
+// must outlive any use of the views.
 //
-// The gil must be held.
+// The gil must be held when constructing, appending to, or destroying this object, but *not* when
+// using the views: the intended use is to construct it, then release the gil while handing the
+// parts off to oxenmq (which makes its own single copy while serializing the outgoing message).
+class data_parts_view {
+public:
+    data_parts_view() = default;
+    explicit data_parts_view(py::handle obj) { append(obj); }
+
+    data_parts_view(data_parts_view&&) = default;
+    data_parts_view& operator=(data_parts_view&&) = default;
+
+    // Appends the parts of `obj`.  Throws on invalid input.
+    void append(py::handle obj) {
+        if (PyBytes_Check(obj.ptr())) {
+            views_.emplace_back(PyBytes_AS_STRING(obj.ptr()), PyBytes_GET_SIZE(obj.ptr()));
+            refs_.push_back(py::reinterpret_borrow<py::object>(obj));
+        } else if (PyUnicode_Check(obj.ptr())) {
+            // The utf-8 encoding is cached inside the str object, so remains valid as long as we
+            // hold a reference.
+            Py_ssize_t size;
+            const char* utf8 = PyUnicode_AsUTF8AndSize(obj.ptr(), &size);
+            if (!utf8)
+                throw py::error_already_set{};
+            views_.emplace_back(utf8, size);
+            refs_.push_back(py::reinterpret_borrow<py::object>(obj));
+        } else if (PyObject_CheckBuffer(obj.ptr())) {
+            std::unique_ptr<Py_buffer, buffer_release> buf{new Py_buffer{}};
+            if (PyObject_GetBuffer(obj.ptr(), buf.get(), PyBUF_SIMPLE) != 0) {
+                buf.release(); // Nothing to release on failure
+                PyErr_Clear();
+                throw std::runtime_error{"invalid value '" + std::string{py::repr(obj)} +
+                    "': buffer is not contiguous"};
+            }
+            views_.emplace_back(static_cast<const char*>(buf->buf), buf->len);
+            buffers_.push_back(std::move(buf));
+        } else if (py::isinstance<py::iterable>(obj)) {
+            for (auto o : obj)
+                append(o);
+        } else {
+            throw std::runtime_error{"invalid value '" + std::string{py::repr(obj)} +
+                "': expected bytes/str/buffer/iterable"};
+        }
+    }
+
+    // The views themselves
+    const std::vector<std::string_view>& views() const { return views_; }
+
+    // Returns a send_option::data_parts value referencing the views, suitable for passing into
+    // oxenmq send/reply methods.
+    auto send_parts() const { return send_option::data_parts(views_.begin(), views_.end()); }
+
+private:
+    struct buffer_release {
+        void operator()(Py_buffer* b) const { PyBuffer_Release(b); delete b; }
+    };
+    std::vector<std::string_view> views_;
+    std::vector<py::object> refs_;
+    std::vector<std::unique_ptr<Py_buffer, buffer_release>> buffers_;
+};
+
+// Converters for to_python_parts: part_bytes copies the part into a bytes object; part_view returns
+// a memoryview of the part's memory, which must therefore outlive the view.
+py::object part_bytes(std::string_view part) { return py::bytes{part.data(), part.size()}; }
+py::object part_view(std::string_view part) { return py::memoryview::from_memory(part.data(), part.size()); }
+
+// Owning buffer for received data: takes over (by moving) a received reply part and exposes it to
+// python through the read-only buffer protocol, so that python can keep received data for as long
+// as it likes without it ever being copied.  Compares equal to, and hashes the same as, bytes with
+// the same content.
+struct owned_buffer {
+    std::string data;
+};
+
+// Moves received parts into a python list of Buffer objects.  The gil must be held.
+py::list to_python_buffers(std::vector<std::string>&& parts) {
+    py::list list(parts.size());
+    for (size_t i = 0; i < parts.size(); i++)
+        list[i] = py::cast(owned_buffer{std::move(parts[i])});
+    return list;
+}
+
+// Converts message parts into a python list (or tuple) of bytes or memoryviews.  The sequence is
+// allocated at its final size up front and filled in place, rather than being grown by appending.
+template <typename Seq = py::list, typename Parts>
+Seq to_python_parts(const Parts& parts, py::object (*convert)(std::string_view)) {
+    Seq seq(parts.size());
+    size_t i = 0;
+    for (const auto& part : parts)
+        seq[i++] = convert(part);
+    return seq;
+}
+
+// Like std::make_shared, but the object is destroyed with the gil held.  This is needed for any
+// shared object holding python references that gets captured into callbacks that oxenmq threads
+// (which don't hold the gil) may copy and destroy.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_gil_shared(Args&&... args) {
+    return {new T{std::forward<Args>(args)...}, [](T* p) {
+        py::gil_scoped_acquire gil;
+        delete p;
+    }};
+}
+using shared_pyobject = std::shared_ptr<py::object>;
+shared_pyobject make_shared_pyobject(py::object o) {
+    return make_gil_shared<py::object>(std::move(o));
+}
+
+// Converts the failure data passed to an on_reply_failure callback into a python exception object:
+// TimeoutError for a request timeout, RuntimeError for anything else.  The gil must be held.
+py::object reply_failure_exception(const py::list& value) {
+    if (len(value) > 0 && (std::string) py::bytes(value[0]) == "TIMEOUT"sv)
+        return py::reinterpret_borrow<py::object>(PyExc_TimeoutError)(
+                len(value) > 1 ? (std::string) py::bytes(value[1]) : "Request timed out"s);
+
+    std::string err;
+    for (auto& m : value) {
+        if (!err.empty()) err += ", ";
+        err += py::str(m);
+    }
+    return py::reinterpret_borrow<py::object>(PyExc_RuntimeError)("Request failed: " + err);
+}
+
+// Creates a new asyncio future attached to the running event loop.  Must be called with the gil
+// held from inside the event loop (i.e. from a coroutine); raises if there is no running loop.
+shared_pyobject make_asyncio_future() {
+    auto loop = py::module_::import("asyncio").attr("get_running_loop")();
+    return make_shared_pyobject(loop.attr("create_future")());
+}
+
+// Resolves an asyncio future created with make_asyncio_future() from an arbitrary thread: the
+// result (or exception, if `exception` is true) is handed to the future's event loop via
+// `call_soon_threadsafe` and is set there unless the future has been cancelled in the meantime.
+// Silently does nothing if the loop has already been closed.  The gil must be held.
+void resolve_asyncio_future(const py::object& future, py::object value, bool exception = false) {
+    // Leaked intentionally: destroying it at exit would happen after the interpreter is gone.
+    static auto* resolver = new py::cpp_function{[](py::object fut, py::object value, bool exception) {
+        if (!fut.attr("done")().cast<bool>())
+            fut.attr(exception ? "set_exception" : "set_result")(std::move(value));
+    }};
+    try {
+        future.attr("get_loop")().attr("call_soon_threadsafe")(*resolver, future, std::move(value), exception);
+    } catch (const py::error_already_set& e) {
+        if (!e.matches(PyExc_RuntimeError))
+            throw;
+    }
+}
+
+// Binds a std::future<T> (where T is some python value type) as a python class.
+template <typename T>
+void bind_future(py::module_& mod, const char* name, const char* doc) {
+    using Future = std::future<T>;
+    py::class_<Future>(mod, name, doc)
+        .def("get", [](Future& f) {
+            if (f.wait_for(std::chrono::seconds::zero()) != std::future_status::ready) {
+                py::gil_scoped_release no_gil;
+                f.wait();
+            }
+            return f.get();
+        }, "Gets the result (or raises an exception if the result raised an exception); must only be called once.  The gil is released while waiting.")
+        .def("valid", [](Future& f) { return f.valid(); },
+                "Returns true if the result is available")
+        .def("wait", &Future::wait, py::call_guard<py::gil_scoped_release>(),
+                "Waits indefinitely for the result to become available")
+        .def("wait_for", &Future::template wait_for<double, std::ratio<1>>,
+                py::call_guard<py::gil_scoped_release>(),
+                "Waits up to the given timedelta for the result to become available")
+        .def("wait_for", [](Future& f, double seconds) {
+            return f.wait_for(std::chrono::duration<double>{seconds}); },
+            py::call_guard<py::gil_scoped_release>(),
+            "Waits up to the given number of seconds for the result to become available")
+        .def("wait_until",
+                &Future::template wait_until<std::chrono::system_clock, std::chrono::system_clock::duration>,
+                py::call_guard<py::gil_scoped_release>(),
+                "Wait until the given datetime for the result to become available")
+        ;
+}
+
+// Converts a python send target (a ConnectionID or a 32-byte pubkey) into a ConnectionID.
+ConnectionID connection_id(std::variant<ConnectionID, py::bytes> conn) {
+    if (auto* bytes = std::get_if<py::bytes>(&conn)) {
+        if (len(*bytes) != 32)
+            throw std::logic_error{"Error: send(...) to=pubkey requires 32-byte pubkey"};
+        return ConnectionID{static_cast<std::string>(*bytes)};
+    }
+    return std::get<ConnectionID>(std::move(conn));
+}
+
+// State shared between the jobs of a batch_map() call.
+struct batch_map_state {
+    py::function func;
+    py::list items;
+    py::list results;
+    std::function<void(py::list)> on_done; // Called with the gil held
+};
+
+// Maps `func` over `items` as an oxenmq batch: each item is a separate batch job that holds the gil
+// only while calling `func`.  `on_done` is called with the list of results (or exception instances
+// for items for which `func` raised) once all jobs have finished, from `thread` if given.  The gil
+// must be held.
+void batch_map(OxenMQ& omq, py::function func, py::list items, std::function<void(py::list)> on_done,
+        std::optional<TaggedThreadID> thread) {
+    const size_t n = items.size();
+    py::list results;
+    for (size_t i = 0; i < n; i++)
+        results.append(py::none());
+    auto state = make_gil_shared<batch_map_state>(std::move(func), std::move(items), std::move(results), std::move(on_done));
+    if (n == 0) {
+        // Nothing to map, but still complete asynchronously (and on `thread`), as for any other batch
+        py::gil_scoped_release no_gil;
+        omq.job([state] {
+            py::gil_scoped_acquire gil;
+            state->on_done(state->results);
+        }, std::move(thread));
+        return;
+    }
+
+    Batch<void> batch;
+    batch.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        batch.add_job([state, i] {
+            py::gil_scoped_acquire gil;
+            try {
+                state->results[i] = state->func(state->items[i]);
+            } catch (py::error_already_set& e) {
+                state->results[i] = e.value();
+            } catch (const std::exception& e) {
+                state->results[i] = py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(e.what());
+            }
+        });
+    batch.completion([state](auto&&) {
+        py::gil_scoped_acquire gil;
+        state->on_done(state->results);
+    }, std::move(thread));
+
+    py::gil_scoped_release no_gil;
+    omq.batch(std::move(batch));
+}
+
+// C ABI for native command handlers registered via Category.add_native_command and
+// add_native_request_command.  The handler is invoked directly on the oxenmq worker thread, without
+// the gil, with the `n_parts` message parts given by `parts`/`lengths`.  For request commands the
+// handler builds the reply by calling `append(reply_ctx, data, length)` once per reply part (and
+// returns 0 to send it, or non-zero to send no reply); for plain commands `append` and `reply_ctx`
+// are null and the return value is ignored.
+extern "C" {
+typedef void (*oxenmq_reply_append)(void* reply_ctx, const char* data, size_t length);
+typedef int (*oxenmq_native_handler)(const char* const* parts, const size_t* lengths, size_t n_parts,
+        oxenmq_reply_append append, void* reply_ctx);
+}
+
+// Capsule name for native handlers passed as a PyCapsule.
+constexpr auto native_handler_capsule = "oxenmq.native_handler";
+
+// Extracts a native handler function pointer from a PyCapsule named `native_handler_capsule`, an int
+// address, or a ctypes function pointer.  The gil must be held.
+oxenmq_native_handler native_handler_ptr(py::handle h) {
+    void* ptr;
+    if (PyCapsule_CheckExact(h.ptr())) {
+        ptr = PyCapsule_GetPointer(h.ptr(), native_handler_capsule);
+        if (!ptr)
+            throw py::error_already_set{};
+    } else if (PyLong_Check(h.ptr())) {
+        ptr = reinterpret_cast<void*>(h.cast<uintptr_t>());
+    } else {
+        auto ctypes = py::module_::import("ctypes");
+        auto addr = ctypes.attr("cast")(h, ctypes.attr("c_void_p")).attr("value");
+        if (addr.is_none())
+            throw std::invalid_argument{"native handler function pointer is null"};
+        ptr = reinterpret_cast<void*>(addr.cast<uintptr_t>());
+    }
+    if (!ptr)
+        throw std::invalid_argument{"native handler function pointer is null"};
+    return reinterpret_cast<oxenmq_native_handler>(ptr);
+}
+
+// Invokes a native handler for `m`, returning the reply parts (or nullopt if the handler declined to
+// reply) for a request, or always nullopt for a non-request.  Does not require the gil.
+std::optional<std::vector<std::string>> invoke_native_handler(oxenmq_native_handler handler, Message& m, bool request) {
+    std::vector<const char*> parts;
+    std::vector<size_t> lengths;
+    parts.reserve(m.data.size());
+    lengths.reserve(m.data.size());
+    for (auto& part : m.data) {
+        parts.push_back(part.data());
+        lengths.push_back(part.size());
+    }
+    if (!request) {
+        handler(parts.data(), lengths.data(), parts.size(), nullptr, nullptr);
+        return std::nullopt;
+    }
+    std::vector<std::string> reply;
+    oxenmq_reply_append append = [](void* ctx, const char* data, size_t length) {
+        static_cast<std::vector<std::string>*>(ctx)->emplace_back(data, length);
+    };
+    if (handler(parts.data(), lengths.data(), parts.size(), append, &reply) != 0)
+        return std::nullopt;
+    return reply;
+}
+
+// Trivial native handler that replies with the number of message parts (in decimal).  Exposed to
+// python as a capsule, `oxenmq.native_count_parts`, so that native commands can be used (and tested)
+// without needing a compiled module of one's own.
+extern "C" int oxenmq_native_count_parts(const char* const*, const size_t*, size_t n_parts,
+        oxenmq_reply_append append, void* reply_ctx) {
+    if (append) {
+        auto n = std::to_string(n_parts);
+        append(reply_ctx, n.data(), n.size());
+    }
+    return 0;
+}
+
+// Quick and dirty logger that logs to stderr.  Used when python_logging isn't enabled.
+struct stderr_logger {
+    inline static std::mutex log_mutex;
+
+    void operator()(LogLevel lvl, const char* file, int line, std::string msg) {
+        std::lock_guard l{log_mutex};
+        std::cerr << '[' << lvl << "][" << file << ':' << line << "]: " << msg << "\n";
+    }
+};
+
+struct log_record {
+    LogLevel level;
+    const char* file;
+    int line;
+    std::string msg;
+};
+
+// Bounded, lock-free, multi-producer/multi-consumer queue of log records (a Vyukov-style ring
+// buffer).  Pushing never blocks: if the ring is full the record is dropped and counted instead,
+// so that oxenmq threads (particularly the proxy thread) never wait on the gil or on I/O to log.
+class log_ring {
+public:
+    // Capacity is rounded up to a power of 2.
+    explicit log_ring(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask_ = size - 1;
+        slots_ = std::make_unique<slot[]>(size);
+        for (size_t i = 0; i < size; i++)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Queues a record; returns false (and increments the dropped count) if the ring is full.
+    bool push(log_record&& rec) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        slot* s;
+        while (true) {
+            s = &slots_[pos & mask_];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        s->rec = std::move(rec);
+        s->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pops the oldest record into `rec`; returns false if the ring is empty.
+    bool pop(log_record& rec) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        slot* s;
+        while (true) {
+            s = &slots_[pos & mask_];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        rec = std::move(s->rec);
+        s->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The total number of records dropped because the ring was full.
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct slot {
+        std::atomic<size_t> seq;
+        log_record rec;
+    };
+    std::unique_ptr<slot[]> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::atomic<uint64_t> dropped_{0};
+};
+
+// Logger that pushes log records into a log_ring, to be drained into python's `logging` by
+// drain_log_ring().
+struct ring_logger {
+    std::shared_ptr<log_ring> ring;
+
+    void operator()(LogLevel lvl, const char* file, int line, std::string msg) {
+        ring->push({lvl, file, line, std::move(msg)});
+    }
+};
+
+// Python logging level for an oxenmq log level.  `trace` maps to 5, below logging.DEBUG.
+int python_log_level(LogLevel lvl) {
+    switch (lvl) {
+        case LogLevel::fatal: return 50;
+        case LogLevel::error: return 40;
+        case LogLevel::warn: return 30;
+        case LogLevel::info: return 20;
+        case LogLevel::debug: return 10;
+        default: return 5;
+    }
+}
+
+// Emits all records currently in `ring` to the python "oxenmq" logger, plus a warning if any
+// records have been dropped since the previous drain.  The gil must be held.
+void drain_log_ring(log_ring& ring, uint64_t& reported_drops) {
+    auto logger = py::module_::import("logging").attr("getLogger")("oxenmq");
+    auto name = logger.attr("name");
+    log_record rec;
+    while (ring.pop(rec)) {
+        int level = python_log_level(rec.level);
+        if (!logger.attr("isEnabledFor")(level).cast<bool>())
+            continue;
+        logger.attr("handle")(logger.attr("makeRecord")(
+                    name, level, rec.file, rec.line, rec.msg, py::tuple{}, py::none()));
+    }
+    if (auto dropped = ring.dropped(); dropped > reported_drops) {
+        logger.attr("warning")("%d oxenmq log messages dropped (log queue full)", dropped - reported_drops);
+        reported_drops = dropped;
+    }
+}
+
+// Lock-free latency histogram with logarithmic buckets (HDR-style: 8 linear sub-buckets per power
+// of 2, for ~12% precision) over nanosecond durations.  Safe to record into from any thread.
+class latency_histogram {
+public:
+    void record(std::chrono::nanoseconds d) {
+        uint64_t ns = d.count() > 0 ? d.count() : 0;
+        buckets_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    // Returns a dict of count, mean, max, and p50/p90/p99/p999 values, in seconds.  Values are
+    // approximate (the upper bound of the percentile's bucket, capped at the max).  The gil must be
+    // held.
+    py::dict snapshot() const {
+        std::array<uint64_t, NBUCKETS> counts;
+        uint64_t total = 0;
+        for (size_t i = 0; i < NBUCKETS; i++)
+            total += counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+
+        py::dict d;
+        d["count"] = total;
+        d["mean"] = total ? sum_.load(std::memory_order_relaxed) * 1e-9 / total : 0.0;
+        d["max"] = max * 1e-9;
+        constexpr std::pair<const char*, double> percentiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+        for (auto [name, p] : percentiles) {
+            uint64_t target = static_cast<uint64_t>(p * total), seen = 0;
+            size_t i = 0;
+            while (i < NBUCKETS - 1 && (seen += counts[i]) <= target)
+                i++;
+            d[name] = total ? std::min(upper_bound(i), max) * 1e-9 : 0.0;
+        }
+        return d;
+    }
+
+private:
+    // 8 exact buckets for 0-7, then 8 buckets for each of the 61 remaining powers of 2.
+    static constexpr size_t NBUCKETS = 8 + 61 * 8;
+
+    static size_t bucket(uint64_t ns) {
+        if (ns < 8)
+            return ns;
+        int msb = 63 - __builtin_clzll(ns);
+        return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+    }
+    static uint64_t upper_bound(size_t i) {
+        if (i < 8)
+            return i;
+        int msb = i / 8 + 2;
+        return ((8 + i % 8 + uint64_t{1}) << (msb - 3)) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, NBUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{0}, sum_{0}, max_{0};
+};
+
+// Invocation statistics for a single registered command.
+struct command_stats {
+    std::atomic<uint64_t> invocations{0}, errors{0};
+    std::atomic<int64_t> in_progress{0};
+    latency_histogram queue_wait, handler_time;
+
+    // RAII guard recording a single invocation, created when the command is invoked: on destruction
+    // records the handler time, and counts an error if destroyed by an exception.  Time spent
+    // between construction and the `started()` call (if called) is recorded as queue wait instead
+    // (this is used to measure time spent waiting for the gil).
+    class call {
+    public:
+        explicit call(command_stats& s, std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now())
+            : stats_{s}, start_{queued}, exceptions_{std::uncaught_exceptions()} {
+            stats_.invocations.fetch_add(1, std::memory_order_relaxed);
+            stats_.in_progress.fetch_add(1, std::memory_order_relaxed);
+        }
+        void started() {
+            auto now = std::chrono::steady_clock::now();
+            stats_.queue_wait.record(now - start_);
+            start_ = now;
+        }
+        ~call() {
+            stats_.handler_time.record(std::chrono::steady_clock::now() - start_);
+            stats_.in_progress.fetch_sub(1, std::memory_order_relaxed);
+            if (std::uncaught_exceptions() > exceptions_)
+                stats_.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        call(const call&) = delete;
+        call& operator=(const call&) = delete;
+    private:
+        command_stats& stats_;
+        std::chrono::steady_clock::time_point start_;
+        int exceptions_;
+    };
+
+    py::dict snapshot() const {
+        py::dict d;
+        d["invocations"] = invocations.load(std::memory_order_relaxed);
+        d["errors"] = errors.load(std::memory_order_relaxed);
+        d["in_progress"] = in_progress.load(std::memory_order_relaxed);
+        d["queue_wait"] = queue_wait.snapshot();
+        d["handler_time"] = handler_time.snapshot();
+        return d;
+    }
+};
+
+// Per-OxenMQ instance statistics.  Held by shared_ptr so that callbacks running during OxenMQ
+// destruction can still safely update them.
+struct omq_stats {
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<command_stats>> commands; // "cat.cmd" -> stats
+
+    std::atomic<uint64_t> messages_sent{0}, requests_sent{0}, replies{0}, reply_failures{0},
+        reply_timeouts{0}, queue_full{0}, queue_failures{0};
+    latency_histogram request_latency;
+
+    // Payload compression (see compression_config): messages sent compressed (with the raw and
+    // compressed payload sizes), sent in a compression envelope but uncompressed (below the
+    // threshold, or incompressible), and received compressed (with sizes) or undecodable.
+    std::atomic<uint64_t> compressed{0}, compressed_raw_bytes{0}, compressed_bytes{0}, uncompressed{0},
+        decompressed{0}, decompressed_bytes{0}, decompressed_raw_bytes{0}, decompress_failures{0},
+        compression_rejected{0};
+
+    // Returns the stats object for a newly registered command.
+    std::shared_ptr<command_stats> add_command(std::string name) {
+        std::lock_guard lock{mutex};
+        auto& st = commands[std::move(name)];
+        if (!st)
+            st = std::make_shared<command_stats>();
+        return st;
+    }
+
+    // Records the outcome of a request sent at `sent`.
+    void record_reply(bool success, const std::vector<std::string>& data, std::chrono::steady_clock::time_point sent) {
+        if (success) {
+            replies.fetch_add(1, std::memory_order_relaxed);
+            request_latency.record(std::chrono::steady_clock::now() - sent);
+        } else if (!data.empty() && data[0] == "TIMEOUT") {
+            reply_timeouts.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            reply_failures.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Payload compression for commands and requests (the compression= options).  A message sent with
+// compression is wrapped in an envelope: a first part holding a header, followed either by the
+// original parts (when not worth compressing) or by a single part holding the compressed,
+// length-prefixed original parts.  The header is:
 //
-// The first version appends into `parts`, the second version returns a vector.
-void extract_data_parts(std::vector<std::string>& parts, py::handle obj) {
-    if (py::isinstance<py::bytes>(obj))
-        parts.push_back(obj.cast<py::bytes>());
-    else if (py::isinstance<py::str>(obj))
-        parts.push_back(obj.cast<py::str>());
-    else if (py::isinstance<py::iterable>(obj)) {
-        for (auto o : obj)
-            extract_data_parts(parts, o);
+//     "\0OMQZ" (5 bytes), version (1 byte; currently 1), accepted algorithms (1 byte bitmask of
+//     1 << compression_algo, nonzero on a request that accepts compressed replies), algorithm (1
+//     byte compression_algo), dictionary id (4 bytes, LE), and uncompressed size (8 bytes, LE).
+//
+// Only commands registered with compression= look for (and strip) the envelope, and replies are
+// only compressed when the request's envelope says the requester accepts them, so peers (and
+// commands) that don't use compression are unaffected.  A request that can't be unwrapped (including
+// one sent to a command registered without compression=) gets a COMPRESSION_ERROR reply, after
+// which the requester sends that command uncompressed messages, while plain messages are only
+// compressed once a compressed request has shown that the command accepts them (see
+// compression_fallbacks).
+enum class compression_algo : uint8_t { none = 0, zstd = 1, lz4 = 2 };
+constexpr uint8_t COMPRESSION_ACCEPT_ALL = (1 << static_cast<uint8_t>(compression_algo::zstd)) |
+    (1 << static_cast<uint8_t>(compression_algo::lz4));
+constexpr std::string_view COMPRESSION_MAGIC{"\0OMQZ\x01", 6};
+constexpr size_t COMPRESSION_HEADER_SIZE = COMPRESSION_MAGIC.size() + 2 + 4 + 8;
+constexpr std::string_view COMPRESSION_ERROR = "COMPRESSION_ERROR"sv;
+
+struct compression_config {
+    compression_algo algo;
+    int level;
+    size_t threshold;
+    size_t max_size;
+    std::string dictionary;
+    uint32_t dict_id = 0; // FNV-1a hash of the dictionary; 0 if none
+
+    compression_config(std::string_view algorithm, std::optional<int> level, size_t threshold,
+            std::string dict, size_t max_size)
+        : threshold{threshold}, max_size{max_size}, dictionary{std::move(dict)} {
+        if (algorithm == "zstd"sv) {
+            algo = compression_algo::zstd;
+            this->level = level.value_or(ZSTD_CLEVEL_DEFAULT);
+        } else if (algorithm == "lz4"sv) {
+            algo = compression_algo::lz4;
+            // For lz4 the level is the acceleration factor: higher is faster, but compresses less.
+            this->level = std::max(level.value_or(1), 1);
+        } else {
+            throw std::invalid_argument{"Invalid compression algorithm '" + std::string{algorithm} +
+                "': expected 'zstd' or 'lz4'"};
+        }
+        if (!dictionary.empty()) {
+            uint32_t h = 2166136261u;
+            for (unsigned char c : dictionary)
+                h = (h ^ c) * 16777619u;
+            dict_id = h ? h : 1;
+        }
+    }
+
+    std::string_view algorithm() const { return algo == compression_algo::zstd ? "zstd"sv : "lz4"sv; }
+};
+
+template <typename Int>
+void append_le(std::string& out, Int val) {
+    for (size_t i = 0; i < sizeof(Int); i++)
+        out += static_cast<char>((val >> (8 * i)) & 0xff);
+}
+template <typename Int>
+Int read_le(std::string_view in) {
+    Int val = 0;
+    for (size_t i = 0; i < sizeof(Int); i++)
+        val |= static_cast<Int>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return val;
+}
+
+// An enveloped (and possibly compressed) message; see compress_parts().
+struct compressed_parts {
+    std::string header;
+    std::string body; // The compressed data, if compressed
+    const std::vector<std::string_view>* original = nullptr; // The original parts, if not
+
+    std::vector<std::string_view> views() const {
+        std::vector<std::string_view> v{header};
+        if (original)
+            v.insert(v.end(), original->begin(), original->end());
+        else
+            v.push_back(body);
+        return v;
+    }
+};
+
+// Wraps `parts` in a compression envelope, compressing them if their total size reaches the
+// threshold and compression actually makes them smaller.  `accept` is the accepted algorithm mask
+// to advertise, and `use_dict` whether the configured dictionary may be used.  Does not need (and
+// should not be called with) the gil.  The returned value references `parts`.
+compressed_parts compress_parts(const compression_config& cfg, const std::vector<std::string_view>& parts,
+        uint8_t accept, bool use_dict, omq_stats& stats) {
+    size_t raw_size = 0;
+    for (auto& p : parts)
+        raw_size += 4 + p.size();
+
+    compressed_parts result;
+    auto algo = compression_algo::none;
+    if (raw_size >= cfg.threshold && raw_size <= LZ4_MAX_INPUT_SIZE) {
+        std::string raw;
+        raw.reserve(raw_size);
+        for (auto& p : parts) {
+            append_le<uint32_t>(raw, p.size());
+            raw += p;
+        }
+        std::string_view dict = use_dict ? std::string_view{cfg.dictionary} : ""sv;
+        size_t size = 0;
+        if (cfg.algo == compression_algo::zstd) {
+            thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx{ZSTD_createCCtx(), &ZSTD_freeCCtx};
+            result.body.resize(ZSTD_compressBound(raw.size()));
+            size = ZSTD_compress_usingDict(cctx.get(), result.body.data(), result.body.size(),
+                    raw.data(), raw.size(), dict.data(), dict.size(), cfg.level);
+            if (ZSTD_isError(size))
+                size = 0;
+        } else {
+            thread_local std::unique_ptr<LZ4_stream_t, decltype(&LZ4_freeStream)> stream{LZ4_createStream(), &LZ4_freeStream};
+            LZ4_resetStream_fast(stream.get());
+            LZ4_loadDict(stream.get(), dict.data(), static_cast<int>(dict.size()));
+            result.body.resize(LZ4_compressBound(static_cast<int>(raw.size())));
+            size = std::max(0, LZ4_compress_fast_continue(stream.get(), raw.data(), result.body.data(),
+                    static_cast<int>(raw.size()), static_cast<int>(result.body.size()), cfg.level));
+        }
+        if (size > 0 && size < raw.size()) {
+            result.body.resize(size);
+            algo = cfg.algo;
+        }
+    }
+
+    result.header.reserve(COMPRESSION_HEADER_SIZE);
+    result.header += COMPRESSION_MAGIC;
+    result.header += static_cast<char>(accept);
+    result.header += static_cast<char>(algo);
+    append_le<uint32_t>(result.header, use_dict ? cfg.dict_id : 0);
+    append_le<uint64_t>(result.header, raw_size);
+    if (algo == compression_algo::none) {
+        result.body.clear();
+        result.original = &parts;
+        stats.uncompressed.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        stats.compressed.fetch_add(1, std::memory_order_relaxed);
+        stats.compressed_raw_bytes.fetch_add(raw_size, std::memory_order_relaxed);
+        stats.compressed_bytes.fetch_add(result.body.size(), std::memory_order_relaxed);
+    }
+    return result;
+}
+
+// True if `parts` start with a compression envelope header.
+bool is_compression_envelope(const std::vector<std::string_view>& parts) {
+    return !parts.empty() && parts[0].size() == COMPRESSION_HEADER_SIZE &&
+        parts[0].substr(0, COMPRESSION_MAGIC.size()) == COMPRESSION_MAGIC;
+}
+
+// Details of a received compression envelope.
+struct compression_envelope {
+    uint8_t accept;  // Algorithms the sender accepts in a reply
+    uint32_t dict_id; // The sender's dictionary id, or 0 if it doesn't use one
+};
+
+// If `parts` is a compression envelope then this replaces `parts` with the original message parts
+// (decompressing them, if compressed, into `storage`, which the new parts then reference) and
+// returns the envelope details; otherwise `parts` are left alone and nullopt is returned.  Throws
+// if the envelope is invalid or can't be decompressed.  Does not need the gil.
+std::optional<compression_envelope> unwrap_parts(const compression_config& cfg,
+        std::vector<std::string_view>& parts, std::string& storage, omq_stats& stats) {
+    if (!is_compression_envelope(parts))
+        return std::nullopt;
+    auto header = parts[0].substr(COMPRESSION_MAGIC.size());
+    compression_envelope env{static_cast<uint8_t>(header[0]), read_le<uint32_t>(header.substr(2))};
+    auto algo = static_cast<compression_algo>(header[1]);
+    auto raw_size = read_le<uint64_t>(header.substr(6));
+
+    if (algo == compression_algo::none) {
+        parts.erase(parts.begin());
+        return env;
+    }
+    if (parts.size() != 2)
+        throw std::runtime_error{"invalid compressed message"};
+    if (raw_size > cfg.max_size)
+        throw std::runtime_error{"compressed message is too large (" + std::to_string(raw_size) + " bytes)"};
+    if (env.dict_id && env.dict_id != cfg.dict_id)
+        throw std::runtime_error{"compressed message uses an unknown dictionary"};
+    std::string_view dict = env.dict_id ? std::string_view{cfg.dictionary} : ""sv;
+
+    auto body = parts[1];
+    storage.resize(raw_size);
+    bool ok;
+    if (algo == compression_algo::zstd) {
+        thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx{ZSTD_createDCtx(), &ZSTD_freeDCtx};
+        auto size = ZSTD_decompress_usingDict(dctx.get(), storage.data(), storage.size(),
+                body.data(), body.size(), dict.data(), dict.size());
+        ok = !ZSTD_isError(size) && size == raw_size;
+    } else if (algo == compression_algo::lz4) {
+        ok = raw_size <= LZ4_MAX_INPUT_SIZE && body.size() <= LZ4_MAX_INPUT_SIZE &&
+            LZ4_decompress_safe_usingDict(body.data(), storage.data(), static_cast<int>(body.size()),
+                    static_cast<int>(raw_size), dict.data(), static_cast<int>(dict.size())) == static_cast<int>(raw_size);
+    } else {
+        throw std::runtime_error{"unsupported compression algorithm " + std::to_string(static_cast<uint8_t>(header[1]))};
+    }
+    if (!ok)
+        throw std::runtime_error{"failed to decompress message"};
+
+    std::vector<std::string_view> result;
+    std::string_view raw{storage};
+    while (!raw.empty()) {
+        if (raw.size() < 4)
+            throw std::runtime_error{"invalid compressed message data"};
+        auto len = read_le<uint32_t>(raw);
+        raw.remove_prefix(4);
+        if (len > raw.size())
+            throw std::runtime_error{"invalid compressed message data"};
+        result.push_back(raw.substr(0, len));
+        raw.remove_prefix(len);
+    }
+    parts = std::move(result);
+    stats.decompressed.fetch_add(1, std::memory_order_relaxed);
+    stats.decompressed_bytes.fetch_add(body.size(), std::memory_order_relaxed);
+    stats.decompressed_raw_bytes.fetch_add(raw_size, std::memory_order_relaxed);
+    return env;
+}
+
+// Set (on the handling thread) while a command registered with compression= handles a request
+// whose sender accepts compressed replies, so that replies to it are compressed.
+struct reply_compression {
+    const Message* msg = nullptr;
+    const compression_config* config = nullptr;
+    compression_envelope envelope{};
+    omq_stats* stats = nullptr;
+};
+thread_local reply_compression current_reply_compression;
+
+// Sends `parts` as the reply to `msg`, compressed if the request negotiated compressed replies.
+// Should be called without the gil.
+void send_reply_parts(Message& msg, const std::vector<std::string_view>& parts) {
+    auto& rc = current_reply_compression;
+    if (rc.msg != &msg || !(rc.envelope.accept & (1 << static_cast<uint8_t>(rc.config->algo)))) {
+        msg.send_reply(send_option::data_parts(parts.begin(), parts.end()));
+        return;
+    }
+    auto c = compress_parts(*rc.config, parts, 0, rc.envelope.dict_id == rc.config->dict_id, *rc.stats);
+    auto views = c.views();
+    msg.send_reply(send_option::data_parts(views.begin(), views.end()));
+}
+
+// Rejects a received compressed message that can't be handled: it is logged and, if it is a
+// request, replied to with COMPRESSION_ERROR and the reason (which the requester turns into a
+// request failure).
+void reject_compressed(Message& m, omq_stats& stats, std::string_view reason) {
+    stats.decompress_failures.fetch_add(1, std::memory_order_relaxed);
+    m.oxenmq.log(LogLevel::warn, __FILE__, __LINE__, "Rejecting compressed message: ", reason);
+    if (!m.reply_tag.empty())
+        m.send_reply(COMPRESSION_ERROR, reason);
+}
+
+// Wraps a command callback for a command registered with compression=: enveloped payloads are
+// unwrapped (and decompressed) before the callback sees the message, and replies sent while the
+// callback runs are compressed if the request accepts it.  Invalid compressed messages are
+// rejected (see reject_compressed).  Runs on the oxenmq worker thread, without the gil.
+std::function<void(Message&)> accept_compressed(std::function<void(Message&)> callback,
+        std::shared_ptr<const compression_config> config, std::shared_ptr<omq_stats> stats) {
+    return [callback = std::move(callback), config = std::move(config), stats = std::move(stats)](Message& m) {
+        std::string storage;
+        std::optional<compression_envelope> env;
+        try {
+            env = unwrap_parts(*config, m.data, storage, *stats);
+        } catch (const std::exception& e) {
+            reject_compressed(m, *stats, e.what());
+            return;
+        }
+        if (!env || !env->accept || m.reply_tag.empty()) {
+            callback(m);
+            return;
+        }
+        auto prev = std::exchange(current_reply_compression, reply_compression{&m, config.get(), *env, stats.get()});
+        try {
+            callback(m);
+        } catch (...) {
+            current_reply_compression = prev;
+            throw;
+        }
+        current_reply_compression = prev;
+    };
+}
+
+// Wraps the callback of a command registered *without* compression= so that a compressed message
+// sent to it is rejected (see reject_compressed) rather than handed to the callback as an
+// undecodable envelope.
+std::function<void(Message&)> refuse_compressed(std::function<void(Message&)> callback, std::shared_ptr<omq_stats> stats) {
+    return [callback = std::move(callback), stats = std::move(stats)](Message& m) {
+        if (is_compression_envelope(m.data)) {
+            reject_compressed(m, *stats, "command does not accept compressed messages");
+            return;
+        }
+        callback(m);
+    };
+}
+
+// What is known about whether each connection's commands accept compressed messages: learned from
+// the replies to compressed requests (see unwrap_reply), or set explicitly.  Requests are sent
+// compressed unless the command is known to reject compression, but plain messages (which get no
+// reply, and so no rejection) only once it is known to accept it.  Bounded by simply starting over
+// once it gets large: relearning only costs one failed request.
+class compression_fallbacks {
+public:
+    // Returns true/false if `command` on `conn` is known to accept/reject compression, nullopt if
+    // unknown.
+    std::optional<bool> supported(const ConnectionID& conn, std::string_view command) {
+        std::lock_guard lock{mutex_};
+        if (known_.empty())
+            return std::nullopt;
+        auto it = known_.find(conn);
+        if (it == known_.end())
+            return std::nullopt;
+        auto c = it->second.find(std::string{command});
+        if (c == it->second.end())
+            return std::nullopt;
+        return c->second;
+    }
+
+    void set(const ConnectionID& conn, std::string command, bool supported) {
+        std::lock_guard lock{mutex_};
+        if (size_ >= MAX_ENTRIES) {
+            known_.clear();
+            size_ = 0;
+        }
+        auto [it, added] = known_[conn].insert_or_assign(std::move(command), supported);
+        if (added)
+            size_++;
+    }
+
+private:
+    static constexpr size_t MAX_ENTRIES = 10000;
+    std::mutex mutex_;
+    std::unordered_map<ConnectionID, std::unordered_map<std::string, bool>> known_;
+    size_t size_ = 0;
+};
+
+// Decompresses (in place) a reply to a request sent with compression; a reply that can't be
+// decompressed is turned into a failure, as is a COMPRESSION_ERROR reply rejecting the request.
+// Returns what the reply says about whether the command accepts compression: true if the reply was
+// enveloped (i.e. from a command registered with compression=), false if it was rejected, nullopt
+// if the reply doesn't tell (e.g. a failure).  Runs on an oxenmq thread, without the gil.
+std::optional<bool> unwrap_reply(const compression_config& config, bool& success, std::vector<std::string>& data, omq_stats& stats) {
+    if (!success)
+        return std::nullopt;
+    if (!data.empty() && data[0] == COMPRESSION_ERROR) {
+        stats.compression_rejected.fetch_add(1, std::memory_order_relaxed);
+        success = false;
+        return false;
+    }
+    std::vector<std::string_view> parts{data.begin(), data.end()};
+    std::string storage;
+    try {
+        if (unwrap_parts(config, parts, storage, stats)) {
+            data = std::vector<std::string>{parts.begin(), parts.end()};
+            return true;
+        }
+    } catch (const std::exception& e) {
+        stats.decompress_failures.fetch_add(1, std::memory_order_relaxed);
+        success = false;
+        data = {"Invalid compressed reply: "s + e.what()};
+    }
+    return std::nullopt;
+}
+
+// Sends the value returned by a python request command handler as the reply to `msg`: None sends
+// nothing, otherwise the value is converted via data_parts_view (and a warning is logged if it
+// isn't convertible).  The gil must be held; if `release_gil` is true it is released while handing
+// the reply off to oxenmq.
+void send_python_reply(Message& msg, const py::object& obj, bool release_gil = true) {
+    if (obj.is_none())
+        return;
+    data_parts_view result;
+    try {
+        result.append(obj);
+    } catch (const std::exception& e) {
+        msg.oxenmq.log(LogLevel::warn, __FILE__, __LINE__, "Python callback returned "s + e.what());
+        return;
+    }
+    if (release_gil) {
+        py::gil_scoped_release no_gil;
+        send_reply_parts(msg, result.views());
     } else {
-        throw std::runtime_error{"invalid value '" + std::string{py::repr(obj)} + "': expected bytes/str/iterable"};
+        send_reply_parts(msg, result.views());
+    }
+}
+
+// Invokes a python command handler with the message and, for handlers registered with
+// parts_tuple=True, a tuple of the message parts as bytes.  The gil must be held.
+py::object invoke_handler(const py::object& handler, Message& m, bool parts_tuple) {
+    if (parts_tuple)
+        return handler(&m, to_python_parts<py::tuple>(m.data, part_bytes));
+    return handler(&m);
+}
+
+// Collects deferred replies (from Message.later()) to be sent together by flush(), which hands all
+// of them off to oxenmq in a single pass without the gil.  The pending entries are guarded by a
+// mutex, so replies may be added from any thread (including without a gil, under free-threading)
+// while another thread flushes.
+class reply_batch {
+public:
+    void add(const Message::DeferredSend& send, py::handle parts) {
+        entry e{send, data_parts_view{parts}};
+        std::lock_guard lock{mutex_};
+        entries_.push_back(std::move(e));
+    }
+
+    size_t size() const {
+        std::lock_guard lock{mutex_};
+        return entries_.size();
+    }
+
+    void clear() {
+        std::vector<entry> dropped;
+        std::lock_guard lock{mutex_};
+        dropped.swap(entries_);
+    }
+
+    // Sends all queued replies and empties the batch; returns the number of replies sent.
+    size_t flush() {
+        // Swap out the entries first so that add() calls from other threads while the gil is
+        // released go into the next batch.
+        std::vector<entry> sending;
+        {
+            std::lock_guard lock{mutex_};
+            sending.swap(entries_);
+        }
+        {
+            py::gil_scoped_release no_gil;
+            for (auto& e : sending)
+                e.send.reply(e.parts.send_parts());
+        }
+        return sending.size();
+    }
+
+private:
+    struct entry {
+        Message::DeferredSend send;
+        data_parts_view parts;
+    };
+    mutable std::mutex mutex_;
+    std::vector<entry> entries_;
+};
+
+// A copy of an incoming command message (and its handler) queued for later dispatch to python by a
+// batch_dispatcher or priority_scheduler, so that the oxenmq worker thread that received it can be
+// freed immediately.  The gil must be held when destroying it.
+struct queued_command {
+    std::vector<std::string> data; // Owned storage that msg.data views
+    Message msg;
+    shared_pyobject callback;
+    std::shared_ptr<command_stats> stats;
+    bool request;
+    bool parts_tuple;
+    std::chrono::steady_clock::time_point queued_at = std::chrono::steady_clock::now();
+
+    queued_command(Message& m, shared_pyobject cb, std::shared_ptr<command_stats> stats, bool request, bool parts_tuple)
+        : data{m.data.begin(), m.data.end()},
+        msg{m.oxenmq, m.conn, m.access, m.remote},
+        callback{std::move(cb)},
+        stats{std::move(stats)},
+        request{request},
+        parts_tuple{parts_tuple} {
+        msg.reply_tag = m.reply_tag;
+        msg.data.assign(data.begin(), data.end());
+    }
+
+    // Invokes the handler (sending its return value as the reply, for a request), logging rather
+    // than propagating any exception.  The gil must be held.
+    void dispatch(OxenMQ& omq) {
+        try {
+            command_stats::call call{*stats, queued_at};
+            call.started();
+            auto result = invoke_handler(*callback, msg, parts_tuple);
+            if (request)
+                send_python_reply(msg, result, false);
+        } catch (const std::exception& e) {
+            omq.log(LogLevel::warn, __FILE__, __LINE__, "Queued python command handler raised: ", e.what());
+        }
+    }
+};
+
+// Batched dispatcher for incoming commands.  Rather than each oxenmq worker thread acquiring the
+// gil to invoke the python handler for each incoming message, commands registered with a
+// dispatcher copy the message into a queue (without touching the gil) and return immediately; a
+// single tagged thread then drains the queue, invoking the python handlers for up to `max_batch`
+// messages under one gil acquisition.  A batch is dispatched as soon as it is full, or once the
+// oldest queued message has been waiting for `max_latency`.
+class batch_dispatcher : public std::enable_shared_from_this<batch_dispatcher> {
+public:
+    batch_dispatcher(OxenMQ& omq, TaggedThreadID thread, size_t max_batch, std::chrono::microseconds max_latency)
+        : omq_{omq}, thread_{std::move(thread)}, max_batch_{std::max<size_t>(max_batch, 1)}, max_latency_{max_latency} {}
+
+    const size_t& max_batch() const { return max_batch_; }
+    const std::chrono::microseconds& max_latency() const { return max_latency_; }
+    uint64_t messages() const { return messages_; }
+    uint64_t batches() const { return batches_; }
+    size_t queued_messages() {
+        std::lock_guard lock{mutex_};
+        return queue_.size();
+    }
+
+    // Copies the message and queues it for dispatch to `callback`.  If `request` is true then the
+    // callback return value is sent as the reply (as with a regular request command); `parts_tuple`
+    // is as for invoke_handler.  Called from an oxenmq worker thread; the gil is not required.
+    void queue(Message& m, shared_pyobject callback, std::shared_ptr<command_stats> stats, bool request,
+            bool parts_tuple) {
+        auto q = std::make_unique<queued_command>(m, std::move(callback), std::move(stats), request, parts_tuple);
+        bool schedule = false, full = false;
+        {
+            std::lock_guard lock{mutex_};
+            queue_.push_back(std::move(q));
+            if (!scheduled_)
+                schedule = scheduled_ = true;
+            else
+                full = queue_.size() == max_batch_;
+        }
+        if (schedule)
+            omq_.job([self = shared_from_this()] { self->drain(); }, thread_);
+        else if (full)
+            cv_.notify_one();
+    }
+
+private:
+    // Runs in the dispatcher's tagged thread: waits for a full batch (or the latency deadline),
+    // then dispatches it.
+    void drain() {
+        std::vector<std::unique_ptr<queued_command>> batch;
+        {
+            std::unique_lock lock{mutex_};
+            if (queue_.size() < max_batch_)
+                cv_.wait_until(lock, queue_.front()->queued_at + max_latency_,
+                        [this] { return queue_.size() >= max_batch_; });
+            size_t n = std::min(queue_.size(), max_batch_);
+            batch.reserve(n);
+            for (size_t i = 0; i < n; i++) {
+                batch.push_back(std::move(queue_.front()));
+                queue_.pop_front();
+            }
+            if (queue_.empty())
+                scheduled_ = false;
+            else
+                omq_.job([self = shared_from_this()] { self->drain(); }, thread_);
+        }
+
+        py::gil_scoped_acquire gil;
+        for (auto& q : batch)
+            q->dispatch(omq_);
+        messages_ += batch.size();
+        batches_++;
+        // Destroy the batch while we still hold the gil (it can hold python references).
+        batch.clear();
+    }
+
+    OxenMQ& omq_;
+    const TaggedThreadID thread_;
+    const size_t max_batch_;
+    const std::chrono::microseconds max_latency_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<queued_command>> queue_;
+    bool scheduled_ = false;
+    std::atomic<uint64_t> messages_{0}, batches_{0};
+};
+
+// Priority scheduler for incoming commands.  Commands routed through the scheduler copy the message
+// into a per-priority FIFO lane and return immediately; the scheduler's tagged threads then each
+// repeatedly dispatch the queued command with the highest effective priority, until the lanes are
+// empty.  The effective priority is the lane's priority plus one for each `aging` interval that the
+// lane's oldest command has been waiting (so that low priority work is delayed, but never starved,
+// under sustained high priority load).  If `max_queue` is non-zero, commands arriving while that
+// many are already queued are dropped (and counted against their lane).
+class priority_scheduler : public std::enable_shared_from_this<priority_scheduler> {
+public:
+    priority_scheduler(OxenMQ& omq, std::vector<TaggedThreadID> threads, std::chrono::microseconds aging,
+            size_t max_queue)
+        : omq_{omq}, threads_{std::move(threads)}, aging_{aging}, max_queue_{max_queue},
+        busy_(threads_.size(), false) {}
+
+    size_t threads() const { return threads_.size(); }
+    const std::chrono::microseconds& aging() const { return aging_; }
+    size_t max_queue() const { return max_queue_; }
+    size_t queued_messages() {
+        std::lock_guard lock{mutex_};
+        return queued_;
+    }
+    uint64_t dropped() {
+        std::lock_guard lock{mutex_};
+        uint64_t n = 0;
+        for (auto& [p, l] : lanes_)
+            n += l.dropped;
+        return n;
+    }
+
+    // Copies the message and queues it at the given priority (or drops it, if the scheduler is
+    // full); see batch_dispatcher::queue for the other arguments.  Called from an oxenmq worker
+    // thread; the gil is not required.
+    void queue(Message& m, shared_pyobject callback, std::shared_ptr<command_stats> stats, bool request,
+            bool parts_tuple, int priority) {
+        auto q = std::make_unique<queued_command>(m, std::move(callback), std::move(stats), request, parts_tuple);
+        size_t idle = threads_.size();
+        {
+            std::lock_guard lock{mutex_};
+            auto& l = lanes_[priority];
+            if (max_queue_ && queued_ >= max_queue_) {
+                l.dropped++;
+                // Let the gil-requiring destruction (of the callback reference) happen elsewhere
+                dropped_.push_back(std::move(q));
+            } else {
+                l.queue.push_back(std::move(q));
+                queued_++;
+                // Wake an idle thread, if there is one; busy threads keep draining until the lanes
+                // are empty, so will pick this up anyway.
+                for (size_t i = 0; i < busy_.size(); i++) {
+                    if (!busy_[i]) {
+                        busy_[i] = true;
+                        idle = i;
+                        break;
+                    }
+                }
+            }
+        }
+        if (idle < threads_.size())
+            omq_.job([self = shared_from_this(), idle] { self->drain(idle); }, threads_[idle]);
+    }
+
+    // Returns a dict of priority to that priority's `dispatched`, `queued` and `dropped` counts and
+    // queue `wait` histogram.  The gil must be held.
+    py::dict stats() {
+        using namespace pybind11::literals;
+        std::lock_guard lock{mutex_};
+        py::dict result;
+        for (auto& [p, l] : lanes_)
+            result[py::int_(p)] = py::dict{
+                "dispatched"_a = l.dispatched,
+                "queued"_a = l.queue.size(),
+                "dropped"_a = l.dropped,
+                "wait"_a = l.wait.snapshot()};
+        return result;
+    }
+
+private:
+    struct lane {
+        std::deque<std::unique_ptr<queued_command>> queue;
+        uint64_t dispatched = 0;
+        uint64_t dropped = 0;
+        latency_histogram wait;
+    };
+
+    // Runs in the scheduler's `i`th tagged thread: dispatches the queued command with the highest
+    // effective priority, one at a time (releasing the gil in between), until the lanes are empty.
+    void drain(size_t i) {
+        while (true) {
+            std::unique_ptr<queued_command> q;
+            std::vector<std::unique_ptr<queued_command>> dropped;
+            {
+                std::lock_guard lock{mutex_};
+                dropped.swap(dropped_);
+                q = take_locked();
+                if (!q)
+                    busy_[i] = false;
+            }
+            bool more = q != nullptr;
+
+            if (q || !dropped.empty()) {
+                py::gil_scoped_acquire gil;
+                if (q)
+                    q->dispatch(omq_);
+                // Destroy while we still hold the gil (they hold python references).
+                q.reset();
+                dropped.clear();
+            }
+            if (!more)
+                return;
+        }
+    }
+
+    // Removes and returns the queued command with the highest effective priority, or nullptr if
+    // nothing is queued.  Must hold the mutex.
+    std::unique_ptr<queued_command> take_locked() {
+        auto now = std::chrono::steady_clock::now();
+        lane* best = nullptr;
+        double best_score = 0;
+        // Highest priority first, so that it wins ties
+        for (auto it = lanes_.rbegin(); it != lanes_.rend(); ++it) {
+            auto& [p, l] = *it;
+            if (l.queue.empty())
+                continue;
+            double score = p;
+            if (aging_.count() > 0)
+                score += std::chrono::duration<double>(now - l.queue.front()->queued_at) / aging_;
+            if (!best || score > best_score) {
+                best = &l;
+                best_score = score;
+            }
+        }
+        if (!best)
+            return nullptr;
+        auto q = std::move(best->queue.front());
+        best->queue.pop_front();
+        queued_--;
+        best->dispatched++;
+        best->wait.record(now - q->queued_at);
+        return q;
+    }
+
+    OxenMQ& omq_;
+    const std::vector<TaggedThreadID> threads_;
+    const std::chrono::microseconds aging_;
+    const size_t max_queue_;
+    std::mutex mutex_;
+    std::map<int, lane> lanes_;
+    size_t queued_ = 0;
+    std::vector<bool> busy_; // Whether each thread has a drain() job scheduled or running
+    std::vector<std::unique_ptr<queued_command>> dropped_; // Dropped commands awaiting destruction
+};
+
+// Topic subscriptions for OxenMQ.publish().  Each subscriber is a connection plus the command it
+// wants notifications delivered to; subscriptions expire unless renewed within their ttl.  Expired
+// subscriptions are pruned lazily, when the topic is next published or counted.
+class pubsub_registry {
+public:
+    // Adds or renews a subscription; returns true if this is a new subscription.  If `max_topics`
+    // is non-zero and `topic` would be a new topic beyond that many then nothing is added and
+    // nullopt is returned.
+    std::optional<bool> subscribe(const std::string& topic, ConnectionID conn, std::string command,
+            std::chrono::milliseconds ttl, size_t max_topics = 0) {
+        std::lock_guard lock{mutex_};
+        if (max_topics && topics_.size() >= max_topics && !topics_.count(topic)) {
+            prune_locked();
+            if (topics_.size() >= max_topics)
+                return std::nullopt;
+        }
+        auto& sub = topics_[topic][std::move(conn)];
+        bool added = sub.command.empty() || sub.expiry < std::chrono::steady_clock::now();
+        sub.command = std::move(command);
+        sub.expiry = std::chrono::steady_clock::now() + ttl;
+        return added;
+    }
+
+    // Removes a subscription; returns true if it existed.
+    bool unsubscribe(const std::string& topic, const ConnectionID& conn) {
+        std::lock_guard lock{mutex_};
+        auto it = topics_.find(topic);
+        if (it == topics_.end() || !it->second.erase(conn))
+            return false;
+        if (it->second.empty())
+            topics_.erase(it);
+        return true;
+    }
+
+    // Returns the current subscribers (and their commands) of `topic`.
+    std::vector<std::pair<ConnectionID, std::string>> subscribers(const std::string& topic) {
+        std::vector<std::pair<ConnectionID, std::string>> result;
+        std::lock_guard lock{mutex_};
+        auto it = topics_.find(topic);
+        if (it == topics_.end())
+            return result;
+        auto now = std::chrono::steady_clock::now();
+        auto& subs = it->second;
+        result.reserve(subs.size());
+        for (auto s = subs.begin(); s != subs.end(); ) {
+            if (s->second.expiry < now) {
+                s = subs.erase(s);
+            } else {
+                result.emplace_back(s->first, s->second.command);
+                ++s;
+            }
+        }
+        if (subs.empty())
+            topics_.erase(it);
+        return result;
+    }
+
+private:
+    // Removes all expired subscriptions, and any topics left without subscribers.  Must hold the
+    // mutex.
+    void prune_locked() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto t = topics_.begin(); t != topics_.end(); ) {
+            auto& subs = t->second;
+            for (auto s = subs.begin(); s != subs.end(); ) {
+                if (s->second.expiry < now)
+                    s = subs.erase(s);
+                else
+                    ++s;
+            }
+            if (subs.empty())
+                t = topics_.erase(t);
+            else
+                ++t;
+        }
+    }
+
+    struct subscription {
+        std::string command;
+        std::chrono::steady_clock::time_point expiry;
+    };
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::unordered_map<ConnectionID, subscription>> topics_;
+};
+
+// Receiving end of a stream sent with OxenMQ.stream_send().  Each chunk of the stream is a request
+// to the stream command; chunks are buffered here as they arrive (possibly out of order, since they
+// can be handled by different worker threads) and each is only acknowledged (replied to) once it
+// has been consumed, which is what holds the sender to its window of unacknowledged chunks.  Chunks
+// outside of the window (or already received) are rejected, so at most `window` chunks are ever
+// buffered.
+class stream_reader : public std::enable_shared_from_this<stream_reader> {
+public:
+    // The result of taking the next chunk: `value` is the chunk for `data` and the error message
+    // for `error`.
+    struct next_result {
+        enum { pending, data, end, error } state = pending;
+        std::string value;
+    };
+
+    stream_reader(OxenMQ& omq, ConnectionID conn, std::chrono::milliseconds timeout, uint64_t window)
+        : omq_{omq}, conn_{std::move(conn)}, timeout_{timeout}, window_{window} {}
+
+    const ConnectionID& conn() const { return conn_; }
+    uint64_t bytes_received() {
+        std::lock_guard lock{mutex_};
+        return received_;
+    }
+
+    // Queues a chunk (`kind` 'd' for data, 'e' for the end of the stream, 'a' for an abort by the
+    // sender).  Called from an oxenmq worker thread; the gil must not be held.
+    void deliver(uint64_t seq, char kind, std::string_view data, Message::DeferredSend ack) {
+        wakeup w; // Declared before the lock so that it is completed after unlocking
+        {
+            std::lock_guard lock{mutex_};
+            if (done_) {
+                ack.reply("CLOSED");
+                return;
+            }
+            if (kind == 'a') {
+                ack.reply("OK");
+                w = finish_locked("stream aborted by sender");
+            } else if (seq < next_ || chunks_.count(seq)) {
+                // Already consumed or already buffered: a broken sender, but it doesn't affect the
+                // chunks we do have.
+                ack.reply("BAD_SEQUENCE");
+            } else if (seq - next_ >= window_) {
+                ack.reply("BAD_SEQUENCE");
+                w = finish_locked("stream sender exceeded its window");
+            } else {
+                received_ += data.size();
+                chunks_.emplace(seq, chunk{kind, std::string{data}, std::move(ack)});
+                if (waiter_) {
+                    auto result = take_locked();
+                    if (result.state != next_result::pending)
+                        w = take_waiter_locked(std::move(result));
+                }
+            }
+        }
+        cv_.notify_all();
+        complete(std::move(w));
+    }
+
+    // Blocks (the gil must not be held) until the next chunk is available.  Fails the stream if
+    // nothing arrives within the timeout.
+    next_result next() {
+        wakeup w;
+        next_result result;
+        {
+            std::unique_lock lock{mutex_};
+            if (!cv_.wait_for(lock, timeout_, [&] {
+                        result = take_locked();
+                        return result.state != next_result::pending; })) {
+                w = finish_locked("stream timed out waiting for data");
+                result = take_locked();
+            }
+        }
+        complete(std::move(w));
+        return result;
+    }
+
+    // Returns an asyncio future for the next chunk.  The gil must be held, from within the event
+    // loop.  The future fails with a RuntimeError if nothing arrives within the timeout.
+    py::object anext() {
+        auto future = make_asyncio_future();
+        std::lock_guard lock{mutex_};
+        if (waiter_)
+            throw std::logic_error{"StreamReader: concurrent __anext__() calls are not supported"};
+        auto result = take_locked();
+        if (result.state == next_result::pending) {
+            waiter_ = future;
+            auto wait = ++waits_;
+            timer_ = omq_.add_timer([weak = weak_from_this(), wait] {
+                if (auto self = weak.lock())
+                    self->wait_timed_out(wait);
+            }, timeout_, false);
+        } else {
+            auto [value, exception] = to_python(std::move(result), true);
+            future->attr(exception ? "set_exception" : "set_result")(std::move(value));
+        }
+        return *future;
+    }
+
+    // Stops the stream: any buffered and future chunks are rejected, which fails the sender, and any
+    // pending reads end.
+    void close() {
+        wakeup w;
+        {
+            std::lock_guard lock{mutex_};
+            w = finish_locked();
+        }
+        cv_.notify_all();
+        complete(std::move(w));
+    }
+
+    // True if the stream has been finished for long enough that any straggling chunks sent before
+    // the sender noticed have arrived, and so the reader can be discarded.
+    bool expired(std::chrono::steady_clock::time_point now) {
+        std::lock_guard lock{mutex_};
+        return done_ && now - done_at_ > timeout_;
+    }
+
+    // Converts a non-pending result into a python (value, is_exception) pair.  For sync iteration
+    // the end of the stream is signalled by throwing StopIteration instead.  The gil must be held.
+    static std::pair<py::object, bool> to_python(next_result r, bool async) {
+        switch (r.state) {
+            case next_result::data: return {py::bytes(r.value), false};
+            case next_result::end:
+                if (!async)
+                    throw py::stop_iteration{};
+                return {py::reinterpret_borrow<py::object>(PyExc_StopAsyncIteration)(), true};
+            default:
+                return {py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(r.value), true};
+        }
+    }
+
+private:
+    struct chunk {
+        char kind;
+        std::string data;
+        Message::DeferredSend ack;
+    };
+
+    // A pending __anext__ future taken out (under the mutex) to be resolved, along with the
+    // cancellation of its timeout timer, by complete() once the mutex is released.
+    struct wakeup {
+        shared_pyobject waiter;
+        next_result result;
+        std::optional<TimerID> timer;
+    };
+
+    wakeup take_waiter_locked(next_result result) {
+        wakeup w{std::move(waiter_), std::move(result), std::move(timer_)};
+        timer_.reset();
+        return w;
+    }
+
+    // Completes a wakeup.  Must not hold the mutex; acquires the gil if there is a waiter.
+    void complete(wakeup w) {
+        if (w.timer)
+            omq_.cancel_timer(*w.timer);
+        if (!w.waiter)
+            return;
+        py::gil_scoped_acquire gil;
+        auto [value, exception] = to_python(std::move(w.result), true);
+        resolve_asyncio_future(*w.waiter, std::move(value), exception);
+        w.waiter.reset();
+    }
+
+    // Timer callback for the `wait`th __anext__ wait: fails the stream if that wait is still pending.
+    void wait_timed_out(uint64_t wait) {
+        wakeup w;
+        {
+            std::lock_guard lock{mutex_};
+            if (wait != waits_ || !waiter_)
+                return;
+            w = finish_locked("stream timed out waiting for data");
+        }
+        cv_.notify_all();
+        complete(std::move(w));
+    }
+
+    // Takes (and acknowledges) the next chunk if it has arrived.  Must hold the mutex.
+    next_result take_locked() {
+        if (error_)
+            return {next_result::error, *error_};
+        if (chunks_.empty() || chunks_.begin()->first != next_)
+            return {done_ ? next_result::end : next_result::pending, {}};
+        auto c = std::move(chunks_.begin()->second);
+        chunks_.erase(chunks_.begin());
+        next_++;
+        c.ack.reply("OK");
+        if (c.kind == 'e') {
+            finish_chunks_locked();
+            return {next_result::end, {}};
+        }
+        return {next_result::data, std::move(c.data)};
+    }
+
+    // Marks the stream finished (with an error, if given), rejecting any unconsumed chunks.  Any
+    // pending __anext__ future is moved out (with the end of stream, or the error, as its result)
+    // into the returned wakeup, which the caller must complete() after releasing the mutex.  Must
+    // hold the mutex.
+    [[nodiscard]] wakeup finish_locked(std::optional<std::string> error = std::nullopt) {
+        if (done_)
+            return {};
+        error_ = std::move(error);
+        finish_chunks_locked();
+        if (!waiter_)
+            return {};
+        return take_waiter_locked(error_ ? next_result{next_result::error, *error_} : next_result{next_result::end, {}});
+    }
+
+    void finish_chunks_locked() {
+        if (done_)
+            return;
+        done_ = true;
+        done_at_ = std::chrono::steady_clock::now();
+        for (auto& [seq, c] : chunks_)
+            c.ack.reply("CLOSED");
+        chunks_.clear();
+    }
+
+    OxenMQ& omq_;
+    const ConnectionID conn_;
+    const std::chrono::milliseconds timeout_;
+    const uint64_t window_; // The maximum number of unconsumed chunks
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<uint64_t, chunk> chunks_;
+    uint64_t next_ = 0;
+    uint64_t received_ = 0;
+    bool done_ = false;
+    std::chrono::steady_clock::time_point done_at_;
+    std::optional<std::string> error_;
+    shared_pyobject waiter_; // Pending __anext__ future
+    std::optional<TimerID> timer_; // Timeout timer of the pending __anext__
+    uint64_t waits_ = 0; // Number of __anext__ waits, to match timer callbacks to waits
+};
+
+// The active streams of a stream command, keyed by connection and sender-chosen stream id.
+// Finished streams are kept (and reject any late chunks) until they expire.
+class stream_registry {
+public:
+    // Returns the reader for a stream, creating it (with the given timeout and window) if needed and
+    // `create` is true; the second value is true if created.  The returned pointer is null if not
+    // found and not created.
+    std::pair<std::shared_ptr<stream_reader>, bool> get(OxenMQ& omq, const ConnectionID& conn,
+            std::string_view id, bool create, std::chrono::milliseconds timeout, uint64_t window) {
+        std::lock_guard lock{mutex_};
+        if (!create) {
+            if (auto c = streams_.find(conn); c != streams_.end())
+                if (auto s = c->second.find(std::string{id}); s != c->second.end())
+                    return {s->second, false};
+            return {nullptr, false};
+        }
+        auto& reader = streams_[conn][std::string{id}];
+        if (reader)
+            return {reader, false};
+        reader = std::make_shared<stream_reader>(omq, conn, timeout, window);
+        prune_locked();
+        return {reader, true};
+    }
+
+private:
+    void prune_locked() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto c = streams_.begin(); c != streams_.end(); ) {
+            for (auto s = c->second.begin(); s != c->second.end(); ) {
+                if (s->second->expired(now))
+                    s = c->second.erase(s);
+                else
+                    ++s;
+            }
+            if (c->second.empty())
+                c = streams_.erase(c);
+            else
+                ++c;
+        }
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<ConnectionID, std::unordered_map<std::string, std::shared_ptr<stream_reader>>> streams_;
+};
+
+// Sends `source` (an object with a read(size) method such as a file, a bytes-like object, or an
+// iterable of these) as a stream to the stream command `command`; see OxenMQ.stream_send.  Must be
+// called with the gil held: it is released while waiting for window credits.  Returns the number
+// of bytes sent.
+uint64_t stream_send(OxenMQ& omq, ConnectionID conn, std::string_view command, py::handle source,
+        size_t chunk_size, size_t window, std::chrono::milliseconds timeout) {
+    if (chunk_size == 0 || window == 0)
+        throw std::invalid_argument{"stream_send: chunk_size and window must be positive"};
+
+    struct send_state {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t outstanding = 0;
+        std::optional<std::string> error;
+        bool timed_out = false;
+    };
+    auto state = std::make_shared<send_state>();
+
+    std::string id(16, '0');
+    {
+        static std::mutex rng_mutex;
+        static std::mt19937_64 rng{std::random_device{}()};
+        std::lock_guard lock{rng_mutex};
+        auto r = rng();
+        for (auto& c : id) {
+            c = "0123456789abcdef"[r & 0xf];
+            r >>= 4;
+        }
+    }
+
+    uint64_t seq = 0, sent = 0;
+    // Sent with each chunk (since any chunk may be the first to arrive) so that the receiver can
+    // enforce it
+    const auto window_str = std::to_string(window);
+
+    // Waits for the in-flight chunk count to drop below `limit`; throws if the stream failed.
+    auto wait_for_window = [&](size_t limit) {
+        {
+            py::gil_scoped_release no_gil;
+            std::unique_lock lock{state->mutex};
+            state->cv.wait(lock, [&] { return state->error || state->outstanding < limit; });
+            if (!state->error)
+                return;
+        }
+        PyErr_SetString(state->timed_out ? PyExc_TimeoutError : PyExc_RuntimeError, state->error->c_str());
+        throw py::error_already_set{};
+    };
+
+    auto send_chunk = [&](char kind, std::string_view data) {
+        wait_for_window(window);
+        {
+            std::lock_guard lock{state->mutex};
+            state->outstanding++;
+        }
+        py::gil_scoped_release no_gil;
+        omq.request(conn, command, [state](bool success, std::vector<std::string> reply) {
+                    std::lock_guard lock{state->mutex};
+                    state->outstanding--;
+                    if (!state->error && !(success && !reply.empty() && reply[0] == "OK")) {
+                        state->timed_out = !success && !reply.empty() && reply[0] == "TIMEOUT";
+                        state->error = state->timed_out ? "stream chunk acknowledgement timed out"
+                            : !reply.empty() && reply[0] == "CLOSED" ? "stream closed by receiver"
+                            : !reply.empty() && reply[0] == "WINDOW_TOO_LARGE" ? "stream window exceeds the receiver's max_window"
+                            : "stream chunk failed: " + (reply.empty() ? "(no reply data)"s : reply[0]);
+                    }
+                    state->cv.notify_all();
+                },
+                id, std::to_string(seq++), std::string_view{&kind, 1}, data, window_str,
+                send_option::request_timeout{timeout});
+        sent += data.size();
+    };
+
+    auto send_piece = [&](py::handle piece) {
+        data_parts_view parts{piece};
+        for (auto part : parts.views())
+            for (size_t pos = 0; pos < part.size(); pos += chunk_size)
+                send_chunk('d', part.substr(pos, chunk_size));
+    };
+
+    try {
+        if (py::hasattr(source, "read")) {
+            auto read = source.attr("read");
+            for (py::object piece = read(chunk_size); py::len(piece) > 0; piece = read(chunk_size))
+                send_piece(piece);
+        } else if (PyBytes_Check(source.ptr()) || PyUnicode_Check(source.ptr()) || PyObject_CheckBuffer(source.ptr())) {
+            send_piece(source);
+        } else {
+            for (auto piece : source)
+                send_piece(piece);
+        }
+        send_chunk('e', {});
+        wait_for_window(1);
+    } catch (...) {
+        // Tell the receiver to give up on the stream rather than waiting for it to time out.
+        py::gil_scoped_release no_gil;
+        omq.request(conn, command, [](bool, std::vector<std::string>) {},
+                id, std::to_string(seq), "a", "", window_str, send_option::request_timeout{timeout});
+        throw;
+    }
+    return sent;
+}
+
+// Single-flight layer for requests sent with coalesce=True: identical requests (same connection,
+// command and data parts) issued while one is already in flight wait for and share its reply rather
+// than being sent again, and with a cache_ttl the successful reply also answers identical requests
+// until it expires.
+class request_coalescer {
+public:
+    using reply_callback = std::function<void(bool success, std::vector<std::string> data)>;
+
+    struct key {
+        ConnectionID conn;
+        std::string request; // command and length-prefixed data parts
+
+        key(ConnectionID conn, std::string_view command, const std::vector<std::string_view>& parts)
+            : conn{std::move(conn)} {
+            size_t size = command.size() + 1;
+            for (auto& p : parts)
+                size += p.size() + sizeof(uint64_t);
+            request.reserve(size);
+            request += command;
+            request += '\0';
+            for (auto& p : parts) {
+                uint64_t len = p.size();
+                request.append(reinterpret_cast<const char*>(&len), sizeof(len));
+                request += p;
+            }
+        }
+        bool operator==(const key& o) const { return conn == o.conn && request == o.request; }
+    };
+
+    // Joins a request.  If an identical request is in flight then `callback` is queued to receive
+    // its reply, and if a cached reply is available then `callback` is scheduled (as an oxenmq job)
+    // with it; either way false is returned.  Otherwise returns true and the caller must send the
+    // request, passing the result to complete().
+    bool join(OxenMQ& omq, const key& k, reply_callback callback) {
+        std::unique_lock lock{mutex_};
+        auto now = std::chrono::steady_clock::now();
+        auto [it, inserted] = entries_.try_emplace(k);
+        auto& e = it->second;
+        if (!inserted && e.in_flight) {
+            e.waiters.push_back(std::move(callback));
+            joined_++;
+            return false;
+        }
+        if (!inserted && e.expiry > now) {
+            hits_++;
+            auto reply = e.reply;
+            lock.unlock();
+            omq.job([callback = std::move(callback), reply = std::move(reply)]() mutable {
+                callback(true, std::move(reply));
+            });
+            return false;
+        }
+        misses_++;
+        e.in_flight = true;
+        e.reply.clear();
+        e.waiters.push_back(std::move(callback));
+        if (inserted && ++inserts_ % 256 == 0)
+            prune_locked(now);
+        return true;
+    }
+
+    // Delivers the reply of a request that join() returned true for to all the waiting callbacks,
+    // and caches it (if successful) for `ttl`.
+    void complete(const key& k, bool success, std::vector<std::string> data, std::chrono::milliseconds ttl) {
+        std::vector<reply_callback> waiters;
+        {
+            std::lock_guard lock{mutex_};
+            auto it = entries_.find(k);
+            if (it == entries_.end())
+                return;
+            waiters = std::move(it->second.waiters);
+            if (success && ttl > 0ms) {
+                auto& e = it->second;
+                e.in_flight = false;
+                e.waiters.clear();
+                e.reply = data;
+                e.expiry = std::chrono::steady_clock::now() + ttl;
+            } else {
+                entries_.erase(it);
+            }
+        }
+        for (size_t i = 0; i < waiters.size(); i++) {
+            if (i + 1 < waiters.size())
+                waiters[i](success, data);
+            else
+                waiters[i](success, std::move(data));
+        }
+    }
+
+    py::dict snapshot() {
+        std::lock_guard lock{mutex_};
+        using namespace pybind11::literals;
+        return py::dict{"hits"_a = hits_, "joined"_a = joined_, "misses"_a = misses_, "entries"_a = entries_.size()};
+    }
+
+private:
+    struct key_hash {
+        size_t operator()(const key& k) const {
+            return std::hash<ConnectionID>{}(k.conn) ^ (std::hash<std::string>{}(k.request) * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+    struct entry {
+        bool in_flight = false;
+        std::vector<reply_callback> waiters;
+        std::vector<std::string> reply; // Cached reply, if expiry is in the future
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    // Drops expired cached replies.  Must hold the mutex.
+    void prune_locked(std::chrono::steady_clock::time_point now) {
+        for (auto it = entries_.begin(); it != entries_.end(); ) {
+            if (!it->second.in_flight && it->second.expiry <= now)
+                it = entries_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<key, entry, key_hash> entries_;
+    uint64_t hits_ = 0, joined_ = 0, misses_ = 0, inserts_ = 0;
+};
+
+// Native service node pubkey -> connection address table, consulted (ahead of any python
+// sn_lookup) when oxenmq needs the address of a service node.  Updates build a new table and swap it
+// in, so a lookup (made from the proxy thread) never waits on an update, never needs the gil, and
+// always sees either the complete old table or the complete new one.
+class sn_address_table {
+public:
+    using table = std::unordered_map<std::string, std::string>;
+
+    // Returns the address of `pubkey`, or an empty string if not in the table.
+    std::string find(std::string_view pubkey) const {
+        auto t = current();
+        auto it = t->find(std::string{pubkey});
+        return it == t->end() ? ""s : it->second;
+    }
+
+    size_t size() const { return current()->size(); }
+
+    void replace(table addresses) {
+        auto t = std::make_shared<const table>(std::move(addresses));
+        std::lock_guard lock{update_mutex_};
+        std::lock_guard tlock{mutex_};
+        table_ = std::move(t);
+    }
+
+    void update(table added, const std::vector<std::string>& removed) {
+        std::lock_guard lock{update_mutex_};
+        auto t = std::make_shared<table>(*current());
+        for (auto& pk : removed)
+            t->erase(pk);
+        for (auto& [pk, addr] : added)
+            (*t)[pk] = std::move(addr);
+        std::lock_guard tlock{mutex_};
+        table_ = std::move(t);
+    }
+
+private:
+    std::shared_ptr<const table> current() const {
+        std::lock_guard lock{mutex_};
+        return table_;
+    }
+
+    mutable std::mutex mutex_;
+    std::mutex update_mutex_; // Serializes updates (which copy the current table)
+    std::shared_ptr<const table> table_ = std::make_shared<const table>();
+};
+
+// Extracts a pubkey (which must be 32 bytes) from a python value.  The gil must be held.
+std::string checked_pubkey(py::handle pk) {
+    if (!PyBytes_Check(pk.ptr()) || PyBytes_GET_SIZE(pk.ptr()) != 32)
+        throw std::invalid_argument{"Invalid pubkey: expected 32-byte bytes"};
+    return {PyBytes_AS_STRING(pk.ptr()), 32};
+}
+
+std::unordered_set<std::string> sn_pubkey_set(py::iterable pubkeys) {
+    std::unordered_set<std::string> result;
+    for (auto pk : pubkeys)
+        result.insert(checked_pubkey(pk));
+    return result;
+}
+
+sn_address_table::table sn_address_map(py::dict addresses) {
+    sn_address_table::table result;
+    result.reserve(addresses.size());
+    for (auto [pk, addr] : addresses)
+        result[checked_pubkey(pk)] = addr.cast<std::string>();
+    return result;
+}
+
+// OxenMQ subclass holding the extra per-instance state used by the python wrapper.  All OxenMQ
+// instances created from python are PyOxenMQ instances.
+class PyOxenMQ : public OxenMQ {
+public:
+    using OxenMQ::OxenMQ;
+
+    // Set when python_logging is enabled
+    std::shared_ptr<log_ring> log_queue;
+
+    std::shared_ptr<omq_stats> stats = std::make_shared<omq_stats>();
+
+    std::shared_ptr<pubsub_registry> pubsub = std::make_shared<pubsub_registry>();
+
+    std::shared_ptr<request_coalescer> coalescer = std::make_shared<request_coalescer>();
+
+    std::shared_ptr<compression_fallbacks> compression_fallback = std::make_shared<compression_fallbacks>();
+
+    // Set by the python constructor (which wires it into the sn lookup)
+    std::shared_ptr<sn_address_table> sn_addresses;
+};
+
+// Deleter for the OxenMQ python holder: destroying an OxenMQ blocks while it joins the proxy and
+// worker threads, which can be waiting on the gil themselves (e.g. to invoke a python handler), so
+// the gil is released during destruction.  Everything holding python references inside OxenMQ
+// (callbacks, handlers, etc.) must therefore be safe to destroy without the gil (e.g. via
+// make_gil_shared or pybind's own std::function wrappers).
+struct omq_deleter {
+    void operator()(PyOxenMQ* omq) const {
+        if (PyGILState_Check()) {
+            py::gil_scoped_release no_gil;
+            delete omq;
+        } else {
+            delete omq;
+        }
+    }
+};
+using omq_holder = std::unique_ptr<PyOxenMQ, omq_deleter>;
+
+// Incoming connection authorization for listen(): checks static deny/allow pubkey sets, then a
+// cache of earlier decisions keyed by (pubkey, remote address, service node status), and only calls
+// the python authorizer (and acquires the gil) on a miss.  oxenmq asks for the decision
+// synchronously from the proxy thread; in background mode a miss never waits on python: the
+// connection immediately gets `pending_level` and the authorizer runs on a tagged thread to fill
+// the cache, so that the remote's next connection attempt gets the real decision.
+class connection_authorizer : public std::enable_shared_from_this<connection_authorizer> {
+public:
+    connection_authorizer(OxenMQ& omq, shared_pyobject callback, std::chrono::milliseconds ttl,
+            size_t max_entries, std::optional<TaggedThreadID> thread, AuthLevel pending_level)
+        : omq_{omq}, callback_{std::move(callback)}, ttl_{ttl}, max_entries_{max_entries},
+        thread_{std::move(thread)}, pending_level_{pending_level} {}
+
+    const std::chrono::milliseconds& ttl() const { return ttl_; }
+    bool background() const { return thread_.has_value(); }
+
+    // Returns the access level for an incoming connection.  Called from the proxy thread, without
+    // the gil.
+    AuthLevel operator()(std::string_view address, std::string_view pubkey, bool sn) {
+        key k{std::string{pubkey}, std::string{address}, sn};
+        {
+            std::lock_guard lock{mutex_};
+            if (!k.pubkey.empty()) {
+                if (deny_.count(k.pubkey)) {
+                    static_hits_++;
+                    return AuthLevel::denied;
+                }
+                if (auto it = allow_.find(k.pubkey); it != allow_.end()) {
+                    static_hits_++;
+                    return it->second;
+                }
+            }
+            if (auto it = cache_.find(k); it != cache_.end()) {
+                if (it->second.expiry > std::chrono::steady_clock::now()) {
+                    hits_++;
+                    return it->second.level;
+                }
+                cache_.erase(it);
+            }
+            misses_++;
+            if (!callback_)
+                return AuthLevel::none;
+            if (thread_) {
+                if (!pending_.insert(k).second)
+                    return pending_level_;
+            }
+        }
+        if (!thread_)
+            return authorize(k);
+        omq_.job([self = shared_from_this(), k] { self->authorize(k); }, *thread_);
+        return pending_level_;
+    }
+
+    // Drops cached decisions: those for the given pubkey and/or address, or all of them if neither
+    // is given.
+    void invalidate(const std::optional<std::string>& pubkey, const std::optional<std::string>& address) {
+        std::lock_guard lock{mutex_};
+        generation_++;
+        if (!pubkey && !address) {
+            cache_.clear();
+            return;
+        }
+        for (auto it = cache_.begin(); it != cache_.end(); ) {
+            if ((!pubkey || it->first.pubkey == *pubkey) && (!address || it->first.address == *address))
+                it = cache_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void allow(std::string pubkey, AuthLevel level) {
+        std::lock_guard lock{mutex_};
+        deny_.erase(pubkey);
+        allow_[std::move(pubkey)] = level;
+    }
+
+    void deny(std::string pubkey) {
+        std::lock_guard lock{mutex_};
+        allow_.erase(pubkey);
+        deny_.insert(std::move(pubkey));
+    }
+
+    // Removes a pubkey from the static allow/deny sets.
+    void forget(const std::string& pubkey) {
+        std::lock_guard lock{mutex_};
+        allow_.erase(pubkey);
+        deny_.erase(pubkey);
+    }
+
+    // The gil must be held.
+    py::dict stats() {
+        using namespace pybind11::literals;
+        std::lock_guard lock{mutex_};
+        return py::dict{
+            "hits"_a = hits_,
+            "static_hits"_a = static_hits_,
+            "misses"_a = misses_,
+            "pending"_a = pending_.size(),
+            "entries"_a = cache_.size()};
+    }
+
+private:
+    struct key {
+        std::string pubkey;
+        std::string address;
+        bool sn;
+        bool operator==(const key& o) const { return sn == o.sn && pubkey == o.pubkey && address == o.address; }
+    };
+    struct key_hash {
+        size_t operator()(const key& k) const {
+            return std::hash<std::string>{}(k.pubkey) ^ (std::hash<std::string>{}(k.address) * 0x9e3779b97f4a7c15ULL) ^ k.sn;
+        }
+    };
+    struct entry {
+        AuthLevel level;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    // Invokes the python authorizer and caches its decision.  An exception from the authorizer
+    // denies the connection (without caching).  Called without the gil.
+    AuthLevel authorize(const key& k) {
+        uint64_t generation;
+        {
+            std::lock_guard lock{mutex_};
+            generation = generation_;
+        }
+        AuthLevel level = AuthLevel::denied;
+        bool ok = false;
+        {
+            py::gil_scoped_acquire gil;
+            try {
+                level = py::cast<AuthLevel>((*callback_)(k.address, py::bytes{k.pubkey}, k.sn));
+                ok = true;
+            } catch (const std::exception& e) {
+                omq_.log(LogLevel::warn, __FILE__, __LINE__, "Python allow_connection authorizer raised: ", e.what());
+            }
+        }
+
+        std::lock_guard lock{mutex_};
+        pending_.erase(k);
+        // Don't cache a decision made before an invalidation
+        if (!ok || ttl_.count() <= 0 || generation != generation_)
+            return level;
+        auto now = std::chrono::steady_clock::now();
+        if (cache_.size() >= max_entries_) {
+            for (auto it = cache_.begin(); it != cache_.end(); ) {
+                if (it->second.expiry <= now)
+                    it = cache_.erase(it);
+                else
+                    ++it;
+            }
+        }
+        if (cache_.size() < max_entries_)
+            cache_[k] = entry{level, now + ttl_};
+        return level;
+    }
+
+    OxenMQ& omq_;
+    const shared_pyobject callback_;
+    const std::chrono::milliseconds ttl_;
+    const size_t max_entries_;
+    const std::optional<TaggedThreadID> thread_;
+    const AuthLevel pending_level_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, AuthLevel> allow_;
+    std::unordered_set<std::string> deny_;
+    std::unordered_map<key, entry, key_hash> cache_;
+    std::unordered_set<key, key_hash> pending_;
+    uint64_t generation_ = 0;
+    uint64_t hits_ = 0, static_hits_ = 0, misses_ = 0;
+};
+
+// Wrapper around oxenmq's CatHelper (returned by OxenMQ.add_category) that also knows the category
+// name and owning OxenMQ, so that commands can be registered for stats.
+struct category_helper {
+    CatHelper cat;
+    PyOxenMQ& omq;
+    std::string name;
+    std::shared_ptr<priority_scheduler> scheduler; // Set if the category was added with scheduler=
+    int priority = 0; // The default command priority, with a scheduler
+
+    // Returns the scheduler and priority (the category default, unless overridden) for a command,
+    // checking the given options.
+    std::pair<std::shared_ptr<priority_scheduler>, int> scheduling(
+            const std::shared_ptr<batch_dispatcher>& dispatcher, std::optional<int> command_priority) {
+        if (command_priority && !scheduler)
+            throw std::logic_error{"priority= requires a category added with scheduler="};
+        if (dispatcher && scheduler)
+            throw std::logic_error{"dispatcher= cannot be used in a category added with scheduler="};
+        return {scheduler, command_priority.value_or(priority)};
+    }
+
+    std::shared_ptr<command_stats> stats_for(const std::string& command) {
+        return omq.stats->add_command(name + "." + command);
+    }
+};
+
+// Queue of completed requests (sent with the completion_queue= option) that can be collected in
+// bulk.  A file descriptor (an eventfd on Linux, otherwise a pipe) is readable whenever the queue is
+// non-empty, so that the queue can be waited on with select/poll/epoll or an asyncio reader.
+class completion_queue {
+public:
+    completion_queue() {
+#ifdef __linux__
+        read_fd_ = write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (read_fd_ == -1)
+            throw std::system_error{errno, std::system_category(), "eventfd() failed"};
+#else
+        int fds[2];
+        if (pipe(fds) == -1)
+            throw std::system_error{errno, std::system_category(), "pipe() failed"};
+        for (int fd : fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        read_fd_ = fds[0];
+        write_fd_ = fds[1];
+#endif
+    }
+
+    ~completion_queue() {
+        close(read_fd_);
+        if (write_fd_ != read_fd_)
+            close(write_fd_);
+    }
+
+    completion_queue(const completion_queue&) = delete;
+    completion_queue& operator=(const completion_queue&) = delete;
+
+    int fileno() const { return read_fd_; }
+
+    size_t size() {
+        std::lock_guard lock{mutex_};
+        return done_.size();
+    }
+
+    // Adds a completed request.  Called from oxenmq threads; the gil is not required.
+    void push(shared_pyobject tag, bool success, std::vector<std::string> data) {
+        {
+            std::lock_guard lock{mutex_};
+            done_.push_back({std::move(tag), success, std::move(data)});
+            if (!signalled_) {
+                signal(true);
+                signalled_ = true;
+            }
+        }
+        cv_.notify_all();
+    }
+
+    // Waits (the gil must not be held) for the queue to be non-empty; returns false on timeout.
+    bool wait(std::optional<std::chrono::milliseconds> timeout) {
+        std::unique_lock lock{mutex_};
+        auto ready = [this] { return !done_.empty(); };
+        if (timeout)
+            return cv_.wait_for(lock, *timeout, ready);
+        cv_.wait(lock, ready);
+        return true;
+    }
+
+    // Removes up to `max` (or all, if nullopt) completed requests, returning them as a list of
+    // (tag, result) tuples where result is the list of Buffer reply parts, or a TimeoutError or
+    // RuntimeError instance for a failed request.  The gil must be held.
+    py::list drain(std::optional<size_t> max) {
+        std::vector<completed> taken;
+        {
+            std::lock_guard lock{mutex_};
+            size_t n = std::min(done_.size(), max.value_or(done_.size()));
+            taken.reserve(n);
+            for (size_t i = 0; i < n; i++) {
+                taken.push_back(std::move(done_.front()));
+                done_.pop_front();
+            }
+            if (done_.empty() && signalled_) {
+                signal(false);
+                signalled_ = false;
+            }
+        }
+        py::list result(taken.size());
+        for (size_t i = 0; i < taken.size(); i++) {
+            auto& c = taken[i];
+            result[i] = py::make_tuple(*c.tag, c.success
+                    ? py::object{to_python_buffers(std::move(c.data))}
+                    : reply_failure_exception(to_python_parts(c.data, part_bytes)));
+        }
+        return result;
+    }
+
+private:
+    struct completed {
+        shared_pyobject tag;
+        bool success;
+        std::vector<std::string> data;
+    };
+
+    // Makes the fd readable (`on`) or clears it.  Must hold the mutex.
+    void signal(bool on) {
+#ifdef __linux__
+        uint64_t val = 1;
+        [[maybe_unused]] auto r = on ? write(write_fd_, &val, sizeof(val)) : read(read_fd_, &val, sizeof(val));
+#else
+        char c = 0;
+        [[maybe_unused]] auto r = on ? write(write_fd_, &c, 1) : read(read_fd_, &c, 1);
+#endif
+    }
+
+    int read_fd_, write_fd_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<completed> done_;
+    bool signalled_ = false;
+};
+
+// Returns kwargs[name] cast to T if present, `def` otherwise.
+template <typename T>
+T kwarg_or(const py::kwargs& kwargs, const char* name, T def) {
+    return kwargs.contains(name) ? kwargs[name].cast<T>() : std::move(def);
+}
+
+// Options for send(), parsed from its keyword arguments.  This is separated from send() itself so
+// that a SendTemplate (see OxenMQ.prepare_send) can parse them just once for repeated sends.
+struct send_options {
+    bool request;
+    bool reply_bytes;
+    bool coalesce;
+    std::chrono::milliseconds cache_ttl;
+    shared_pyobject on_reply, on_reply_failure;
+    std::shared_ptr<completion_queue> completions;
+    shared_pyobject tag;
+    std::shared_ptr<const compression_config> compression;
+    send_option::hint hint;
+    send_option::optional optional;
+    send_option::incoming incoming;
+    send_option::outgoing outgoing;
+    send_option::keep_alive keep_alive;
+    send_option::request_timeout request_timeout;
+    send_option::queue_failure qfail;
+    send_option::queue_full qfull;
+
+    // Parses the options.  The gil must be held.
+    send_options(PyOxenMQ& omq, const py::kwargs& kwargs)
+        : request{kwarg_or(kwargs, "request", false)},
+        reply_bytes{kwarg_or(kwargs, "reply_bytes", false)},
+        coalesce{kwarg_or(kwargs, "coalesce", false)},
+        cache_ttl{kwarg_or(kwargs, "cache_ttl", 0ms)},
+        compression{kwarg_or(kwargs, "compression", std::shared_ptr<compression_config>{})},
+        hint{kwarg_or(kwargs, "remote_hint", ""s)},
+        optional{kwarg_or(kwargs, "optional", false)},
+        incoming{kwarg_or(kwargs, "incoming_only", false)},
+        outgoing{kwarg_or(kwargs, "outgoing", false)},
+        keep_alive{kwarg_or(kwargs, "keep_alive", -1ms)},
+        request_timeout{kwarg_or(kwargs, "request_timeout", -1ms)} {
+
+        if (request) {
+            if (kwargs.contains("on_reply"))
+                on_reply = make_shared_pyobject(kwargs["on_reply"].cast<py::function>());
+            if (kwargs.contains("on_reply_failure"))
+                on_reply_failure = make_shared_pyobject(kwargs["on_reply_failure"].cast<py::function>());
+        } else if (kwargs.contains("on_reply") || kwargs.contains("on_reply_failure")) {
+            throw std::logic_error{"Error: send(...) on_reply=/on_reply_failure= option "
+                "requires request=True (perhaps you meant to use `.request(...)` instead?)"};
+        }
+        if (kwargs.contains("completion_queue") && !kwargs["completion_queue"].is_none()) {
+            if (!request || on_reply || on_reply_failure)
+                throw std::logic_error{"Error: send(...) completion_queue= option requires request=True "
+                    "and cannot be combined with on_reply=/on_reply_failure="};
+            completions = kwargs["completion_queue"].cast<std::shared_ptr<completion_queue>>();
+            tag = make_shared_pyobject(kwargs.contains("tag") ? py::object{kwargs["tag"]} : py::none());
+        }
+        if (cache_ttl > 0ms)
+            coalesce = true;
+        if (coalesce && !request)
+            throw std::logic_error{"Error: send(...) coalesce=/cache_ttl= options require request=True"};
+
+        std::function<void(std::string error)> on_qfail;
+        if (kwargs.contains("queue_failure"))
+            on_qfail = kwargs["queue_failure"].cast<std::function<void(std::string error)>>();
+        qfail.callback = [stats = omq.stats, f = std::move(on_qfail)](const zmq::error_t* exc) {
+            stats->queue_failures.fetch_add(1, std::memory_order_relaxed);
+            if (f && exc)
+                f(exc->what());
+        };
+        std::function<void()> on_qfull;
+        if (kwargs.contains("queue_full"))
+            on_qfull = kwargs["queue_full"].cast<std::function<void()>>();
+        qfull.callback = [stats = omq.stats, f = std::move(on_qfull)] {
+            stats->queue_full.fetch_add(1, std::memory_order_relaxed);
+            if (f)
+                f();
+        };
+    }
+
+    // Called with the outcome of a request actually sent over the network (i.e. not for requests
+    // answered by coalescing).  Invoked from an oxenmq thread without the gil.
+    using reply_observer = std::function<void(bool success, const std::vector<std::string>& data)>;
+
+    // Sends `data` to `conn` with these options.  The gil must be held; it is released while the
+    // message is handed off to oxenmq.
+    void send(PyOxenMQ& omq, ConnectionID conn, std::string_view command, const data_parts_view& data,
+            reply_observer observe = nullptr) const {
+        // Requests are compressed unless the command has rejected compression (which the reply will
+        // tell us), but plain messages only once it is known to accept it.
+        bool compress = false;
+        if (compression) {
+            auto supported = omq.compression_fallback->supported(conn, command);
+            compress = request ? supported.value_or(true) : supported.value_or(false);
+        }
+        if (!request) {
+            omq.stats->messages_sent.fetch_add(1, std::memory_order_relaxed);
+            py::gil_scoped_release no_gil;
+            if (compress) {
+                auto c = compress_parts(*compression, data.views(), 0, true, *omq.stats);
+                auto views = c.views();
+                omq.send(std::move(conn), command, send_option::data_parts(views.begin(), views.end()),
+                        hint, optional, incoming, outgoing, keep_alive, request_timeout, qfail, qfull);
+            } else {
+                omq.send(std::move(conn), command, data.send_parts(),
+                        hint, optional, incoming, outgoing, keep_alive, request_timeout, qfail, qfull);
+            }
+            return;
+        }
+
+        request_coalescer::reply_callback deliver;
+        if (completions) {
+            deliver = [completions = completions, tag = tag](bool success, std::vector<std::string> data) {
+                completions->push(tag, success, std::move(data));
+            };
+        } else {
+            deliver = [reply = on_reply, fail = on_reply_failure, reply_bytes = reply_bytes]
+                (bool success, std::vector<std::string> data) {
+                    if (!(success ? reply : fail))
+                        return;
+
+                    // The captured callbacks are shared_pyobjects so that copying and destroying
+                    // this lambda from oxenmq threads is safe without the gil.
+                    py::gil_scoped_acquire gil;
+
+                    if (success)
+                        (*reply)(reply_bytes ? to_python_parts(data, part_bytes) : to_python_buffers(std::move(data)));
+                    else
+                        (*fail)(to_python_parts(data, part_bytes));
+                };
+        }
+
+        std::shared_ptr<const compression_config> reply_compression;
+        std::function<void(bool)> on_supported;
+        if (compress) {
+            reply_compression = compression;
+            on_supported = [fallbacks = omq.compression_fallback, conn, command = std::string{command}](bool supported) {
+                if (fallbacks->supported(conn, command) != supported)
+                    fallbacks->set(conn, command, supported);
+            };
+        }
+
+        OxenMQ::ReplyCallback reply_cb;
+        auto sent = std::chrono::steady_clock::now();
+        if (coalesce) {
+            request_coalescer::key key{conn, command, data.views()};
+            if (!omq.coalescer->join(omq, key, std::move(deliver)))
+                return;
+            reply_cb = [stats = omq.stats, sent, observe = std::move(observe), compression = reply_compression,
+                    on_supported, coalescer = omq.coalescer, key = std::move(key), ttl = cache_ttl]
+                (bool success, std::vector<std::string> data) {
+                    if (compression)
+                        if (auto supported = unwrap_reply(*compression, success, data, *stats))
+                            on_supported(*supported);
+                    stats->record_reply(success, data, sent);
+                    if (observe)
+                        observe(success, data);
+                    coalescer->complete(key, success, std::move(data), ttl);
+                };
+        } else {
+            reply_cb = [stats = omq.stats, sent, observe = std::move(observe), compression = reply_compression,
+                    on_supported = std::move(on_supported), deliver = std::move(deliver)]
+                (bool success, std::vector<std::string> data) {
+                    if (compression)
+                        if (auto supported = unwrap_reply(*compression, success, data, *stats))
+                            on_supported(*supported);
+                    stats->record_reply(success, data, sent);
+                    if (observe)
+                        observe(success, data);
+                    deliver(success, std::move(data));
+                };
+        }
+
+        omq.stats->requests_sent.fetch_add(1, std::memory_order_relaxed);
+        py::gil_scoped_release no_gil;
+        if (compress) {
+            auto c = compress_parts(*compression, data.views(), COMPRESSION_ACCEPT_ALL, true, *omq.stats);
+            auto views = c.views();
+            omq.request(std::move(conn), command, std::move(reply_cb), send_option::data_parts(views.begin(), views.end()),
+                    hint, optional, incoming, outgoing, keep_alive, request_timeout, qfail, qfull);
+        } else {
+            omq.request(std::move(conn), command, std::move(reply_cb), data.send_parts(),
+                    hint, optional, incoming, outgoing, keep_alive, request_timeout, qfail, qfull);
+        }
+    }
+};
+
+// A command plus send options prepared by OxenMQ.prepare_send for repeated sends.
+struct send_template {
+    PyOxenMQ& omq;
+    std::string command;
+    send_options options;
+};
+
+// Pool of connections to a set of equivalent remotes, routing each request to one of them.  Backends
+// are chosen either by fewest outstanding requests or by lowest expected latency (EWMA latency
+// scaled by outstanding requests).  A backend with `max_failures` consecutive failed requests is
+// ejected for `ejection_time` and reconnected; backends that fail to connect are retried with the
+// OxenMQ reconnect_interval backoff.  All of this happens without the gil.
+class remote_pool : public std::enable_shared_from_this<remote_pool> {
+public:
+    enum class strategy { least_outstanding, ewma };
+
+    remote_pool(PyOxenMQ& omq, std::vector<address> remotes, strategy strat, unsigned max_failures,
+            std::chrono::milliseconds ejection_time, double ewma_alpha, AuthLevel auth_level)
+        : omq_{omq}, strategy_{strat}, max_failures_{std::max(max_failures, 1u)},
+        ejection_time_{ejection_time}, ewma_alpha_{ewma_alpha}, auth_level_{auth_level} {
+        if (remotes.empty())
+            throw std::invalid_argument{"RemotePool requires at least one remote"};
+        if (!(ewma_alpha > 0 && ewma_alpha <= 1))
+            throw std::invalid_argument{"RemotePool ewma_alpha must be in (0, 1]"};
+        backends_.reserve(remotes.size());
+        for (auto& r : remotes)
+            backends_.emplace_back(std::move(r), omq.RECONNECT_INTERVAL);
+    }
+
+    ~remote_pool() {
+        if (timer_)
+            omq_.cancel_timer(*timer_);
+        for (auto& b : backends_)
+            if (b.conn)
+                omq_.disconnect(std::move(*b.conn));
+    }
+
+    // Starts connecting to the backends, and the timer that handles reconnections.  Must be called
+    // once, after construction.
+    void start() {
+        for (size_t i = 0; i < backends_.size(); i++)
+            connect(i);
+        auto interval = std::max<std::chrono::milliseconds>(omq_.RECONNECT_INTERVAL, 10ms);
+        timer_ = omq_.add_timer([weak = weak_from_this()] {
+            if (auto self = weak.lock())
+                self->maintain();
+        }, interval);
+    }
+
+    struct picked {
+        size_t index;
+        uint64_t generation; // The backend's connection generation, to pass back to finished()
+        ConnectionID conn;
+    };
+
+    // Picks a backend for a new request and counts the request as outstanding on it.  Returns
+    // nullopt if no backend is currently available.
+    std::optional<picked> pick() {
+        std::lock_guard lock{mutex_};
+        auto now = std::chrono::steady_clock::now();
+        size_t n = backends_.size(), best = n;
+        double best_score = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t i = (next_ + k) % n;
+            auto& b = backends_[i];
+            if (!b.available(now))
+                continue;
+            double score = strategy_ == strategy::ewma
+                ? (b.ewma_ns + 1.0) * (b.outstanding + 1)
+                : static_cast<double>(b.outstanding);
+            if (best == n || score < best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best == n)
+            return std::nullopt;
+        // Start the next scan just after this pick so that ties rotate evenly across the available
+        // backends (rotating over all of them would favour whichever follows an unavailable one).
+        next_ = (best + 1) % n;
+        auto& b = backends_[best];
+        b.outstanding++;
+        b.requests++;
+        return picked{best, b.generation, *b.conn};
+    }
+
+    // Records the outcome of a request sent to backend `i` (on its connection `generation`) by
+    // pick().  Outcomes of requests sent on an earlier connection, such as the timeouts of requests
+    // still in flight when the backend was ejected, say nothing about the current connection and
+    // are ignored.  Called from oxenmq threads.
+    void finished(size_t i, uint64_t generation, bool success, std::chrono::steady_clock::duration latency) {
+        std::optional<ConnectionID> drop;
+        {
+            std::lock_guard lock{mutex_};
+            auto& b = backends_[i];
+            b.outstanding--;
+            if (generation != b.generation)
+                return;
+            if (success) {
+                b.consecutive_failures = 0;
+                double ns = std::chrono::duration<double, std::nano>(latency).count();
+                b.ewma_ns = b.ewma_ns == 0 ? ns : ewma_alpha_ * ns + (1 - ewma_alpha_) * b.ewma_ns;
+                return;
+            }
+            b.failures++;
+            if (++b.consecutive_failures < max_failures_ || b.state != backend::connected)
+                return;
+            // Don't eject the last available backend: failing over to nothing doesn't help.
+            auto now = std::chrono::steady_clock::now();
+            bool others = false;
+            for (size_t j = 0; j < backends_.size() && !others; j++)
+                others = j != i && backends_[j].available(now);
+            if (!others)
+                return;
+            b.ejections++;
+            b.consecutive_failures = 0;
+            b.ejected_until = now + ejection_time_;
+            b.ewma_ns = 0;
+            b.state = backend::disconnected;
+            b.retry_at = now;
+            drop = std::move(b.conn);
+            b.conn.reset();
+        }
+        // Replace the connection (which may well be the problem) when the timer next runs
+        if (drop)
+            omq_.disconnect(std::move(*drop), 0ms);
+    }
+
+    PyOxenMQ& omq() { return omq_; }
+
+    // Sends a request to the best available backend, tracking its outcome.  Throws if no backend is
+    // available.  The gil must be held (see send_options::send).
+    void request(std::string_view command, const data_parts_view& data, const send_options& options) {
+        auto p = pick();
+        if (!p)
+            throw std::runtime_error{"RemotePool: no backend is currently available"};
+        options.send(omq_, std::move(p->conn), command, data,
+                [weak = weak_from_this(), i = p->index, generation = p->generation, sent = std::chrono::steady_clock::now()]
+                (bool success, const std::vector<std::string>&) {
+                    if (auto self = weak.lock())
+                        self->finished(i, generation, success, std::chrono::steady_clock::now() - sent);
+                });
+    }
+
+    // Returns a list of per-backend status dicts.  The gil must be held.
+    py::list status() {
+        using namespace pybind11::literals;
+        std::lock_guard lock{mutex_};
+        auto now = std::chrono::steady_clock::now();
+        py::list result;
+        for (auto& b : backends_)
+            result.append(py::dict{
+                    "address"_a = b.addr,
+                    "state"_a = b.state == backend::connected ? "connected"
+                        : b.state == backend::connecting ? "connecting" : "disconnected",
+                    "ejected"_a = b.ejected_until > now,
+                    "outstanding"_a = b.outstanding,
+                    "requests"_a = b.requests,
+                    "failures"_a = b.failures,
+                    "ejections"_a = b.ejections,
+                    "latency"_a = b.ewma_ns > 0 ? py::cast(b.ewma_ns * 1e-9) : py::none()});
+        return result;
+    }
+
+private:
+    struct backend {
+        address addr;
+        std::optional<ConnectionID> conn;
+        enum { connecting, connected, disconnected } state = disconnected;
+        std::chrono::milliseconds backoff;
+        std::chrono::steady_clock::time_point retry_at, ejected_until;
+        uint64_t outstanding = 0, requests = 0, failures = 0, ejections = 0;
+        unsigned consecutive_failures = 0;
+        double ewma_ns = 0;
+        uint64_t generation = 0; // Incremented with each new connection
+
+        backend(address addr, std::chrono::milliseconds backoff) : addr{std::move(addr)}, backoff{backoff} {}
+
+        bool available(std::chrono::steady_clock::time_point now) const {
+            return state == connected && ejected_until <= now;
+        }
+    };
+
+    void connect(size_t i) {
+        address addr;
+        {
+            std::lock_guard lock{mutex_};
+            backends_[i].state = backend::connecting;
+            addr = backends_[i].addr;
+        }
+        auto weak = weak_from_this();
+        omq_.connect_remote(addr,
+                [weak, i, &omq = omq_](ConnectionID conn) {
+                    if (auto self = weak.lock()) {
+                        std::lock_guard lock{self->mutex_};
+                        auto& b = self->backends_[i];
+                        b.conn = std::move(conn);
+                        b.generation++;
+                        b.state = backend::connected;
+                        b.consecutive_failures = 0;
+                        b.backoff = self->omq_.RECONNECT_INTERVAL;
+                    } else {
+                        // The pool was destroyed while connecting
+                        omq.disconnect(std::move(conn));
+                    }
+                },
+                [weak, i](ConnectionID, std::string_view) {
+                    if (auto self = weak.lock()) {
+                        std::lock_guard lock{self->mutex_};
+                        auto& b = self->backends_[i];
+                        b.state = backend::disconnected;
+                        b.retry_at = std::chrono::steady_clock::now() + b.backoff;
+                        b.backoff = std::min(b.backoff * 2, std::max(self->omq_.RECONNECT_INTERVAL_MAX, b.backoff));
+                    }
+                },
+                auth_level_);
+    }
+
+    // Runs on a timer: reconnects disconnected backends that are due for a retry.
+    void maintain() {
+        std::vector<size_t> reconnect;
+        {
+            std::lock_guard lock{mutex_};
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < backends_.size(); i++)
+                if (backends_[i].state == backend::disconnected && backends_[i].retry_at <= now)
+                    reconnect.push_back(i);
+        }
+        for (auto i : reconnect)
+            connect(i);
+    }
+
+    PyOxenMQ& omq_;
+    const strategy strategy_;
+    const unsigned max_failures_;
+    const std::chrono::milliseconds ejection_time_;
+    const double ewma_alpha_;
+    const AuthLevel auth_level_;
+    std::mutex mutex_;
+    std::vector<backend> backends_;
+    size_t next_ = 0;
+    std::optional<TimerID> timer_;
+};
+
+// Shared state of a request_many() fan-out of a single request to multiple targets.  Replies are
+// recorded (without the gil) as they arrive; once all replies have arrived, or the quorum is met
+// (or can no longer be met), `on_done` is invoked exactly once with the gil held and a dict of
+// per-target results.  Must be created with make_gil_shared() so that the python objects inside are
+// released under the gil.
+struct request_gather {
+    py::tuple targets; // The targets, for the result keys
+    std::function<void(py::dict)> on_done;
+    std::optional<size_t> quorum;
+
+    std::mutex mutex;
+    std::vector<std::optional<std::pair<bool, std::vector<std::string>>>> results;
+    size_t pending;
+    size_t successes = 0;
+    bool finished = false;
+
+    void reply(size_t i, bool success, std::vector<std::string> data) {
+        {
+            std::lock_guard lock{mutex};
+            if (finished)
+                return;
+            results[i].emplace(success, std::move(data));
+            pending--;
+            if (success)
+                successes++;
+            if (pending > 0 && !(quorum && (successes >= *quorum || successes + pending < *quorum)))
+                return;
+            finished = true;
+        }
+        py::gil_scoped_acquire gil;
+        on_done(result_dict());
+    }
+
+    // Builds the results dict.  The gil must be held, and `finished` must have been set (by the
+    // calling thread) so that `results` is no longer being modified.
+    py::dict result_dict() {
+        py::dict d;
+        size_t i = 0;
+        for (auto target : targets) {
+            auto& r = results[i++];
+            if (!r)
+                d[target] = py::none();
+            else {
+                auto& [success, data] = *r;
+                if (success)
+                    d[target] = to_python_buffers(std::move(data));
+                else
+                    d[target] = reply_failure_exception(to_python_parts(data, part_bytes));
+            }
+        }
+        return d;
+    }
+};
+
+// Starts a request_many() fan-out; `on_done` is invoked with the results dict when it completes.
+// The gil must be held.
+void request_many(PyOxenMQ& omq, py::tuple targets, std::string_view command, py::args args,
+        std::optional<size_t> quorum, std::chrono::milliseconds timeout,
+        std::function<void(py::dict)> on_done) {
+    std::vector<ConnectionID> conns;
+    conns.reserve(targets.size());
+    std::unordered_set<ConnectionID> seen;
+    for (auto t : targets) {
+        auto& conn = conns.emplace_back(connection_id(t.cast<std::variant<ConnectionID, py::bytes>>()));
+        // The results are keyed by target, so a repeated target would collapse into one result
+        // while still counting twice towards the quorum.
+        if (!seen.insert(conn).second)
+            throw std::invalid_argument{"request_many targets must not contain duplicates"};
+    }
+    if (quorum && *quorum > conns.size())
+        throw std::invalid_argument{"request_many quorum cannot exceed the number of targets"};
+
+    auto gather = make_gil_shared<request_gather>();
+    gather->targets = std::move(targets);
+    gather->on_done = std::move(on_done);
+    gather->quorum = quorum;
+    gather->results.resize(conns.size());
+    gather->pending = conns.size();
+    if (conns.empty() || (quorum && *quorum == 0)) {
+        gather->finished = true;
+        gather->on_done(gather->result_dict());
+        return;
+    }
+
+    data_parts_view data{args};
+    auto& stats = omq.stats;
+    stats->requests_sent.fetch_add(conns.size(), std::memory_order_relaxed);
+    auto sent = std::chrono::steady_clock::now();
+    py::gil_scoped_release no_gil;
+    for (size_t i = 0; i < conns.size(); i++)
+        omq.request(std::move(conns[i]), command,
+                [gather, i, stats, sent](bool success, std::vector<std::string> data) {
+                    stats->record_reply(success, data, sent);
+                    gather->reply(i, success, std::move(data));
+                },
+                data.send_parts(),
+                send_option::request_timeout{timeout});
+}
+
+// Maximum list/dict nesting accepted by bt_encode/bt_decode; this protects against stack exhaustion
+// from (possibly malicious) deeply nested input, and from self-referencing python containers.
+constexpr int BT_MAX_DEPTH = 256;
+
+// Converts a python value into a bt_value for bt_serialize.  bytes, str and other buffer objects
+// become strings (referenced, not copied: `refs` holds them), ints become integers, dicts (with
+// bytes or str keys) become dicts and any other iterable becomes a list.  The gil must be held.
+bt_value bt_from_python(py::handle obj, data_parts_view& refs, int depth = 0) {
+    if (depth > BT_MAX_DEPTH)
+        throw std::invalid_argument{"bt_encode: value is nested too deeply"};
+    if (PyLong_Check(obj.ptr())) {
+        int overflow;
+        auto i = PyLong_AsLongLongAndOverflow(obj.ptr(), &overflow);
+        if (overflow == 0)
+            return int64_t{i};
+        if (overflow > 0) {
+            auto u = PyLong_AsUnsignedLongLong(obj.ptr());
+            if (PyErr_Occurred())
+                throw py::error_already_set{};
+            return uint64_t{u};
+        }
+        throw std::overflow_error{"bt_encode: integer value is too small"};
+    }
+    if (PyBytes_Check(obj.ptr()) || PyUnicode_Check(obj.ptr()) || PyObject_CheckBuffer(obj.ptr())) {
+        refs.append(obj);
+        return refs.views().back();
+    }
+    if (PyDict_Check(obj.ptr())) {
+        bt_dict d;
+        for (auto [k, v] : py::reinterpret_borrow<py::dict>(obj)) {
+            if (!PyBytes_Check(k.ptr()) && !PyUnicode_Check(k.ptr()))
+                throw std::invalid_argument{"bt_encode: dict keys must be bytes or str, not " +
+                    std::string{py::str(k.get_type().attr("__name__"))}};
+            refs.append(k);
+            d[std::string{refs.views().back()}] = bt_from_python(v, refs, depth + 1);
+        }
+        return d;
+    }
+    if (py::isinstance<py::iterable>(obj)) {
+        bt_list l;
+        for (auto v : obj)
+            l.push_back(bt_from_python(v, refs, depth + 1));
+        return l;
+    }
+    throw std::invalid_argument{"bt_encode: cannot encode value of type " +
+        std::string{py::str(obj.get_type().attr("__name__"))}};
+}
+
+class bt_dict_view;
+class bt_list_view;
+
+// Consumes the next value from a bt_list_consumer or bt_dict_consumer as a python value: bytes for
+// strings and int for integers; lists and dicts are either decoded in full (recursively) or, if
+// `src` is set, returned as lazy bt_list_view/bt_dict_view objects sharing `src`.  The gil must be
+// held.
+template <typename Consumer>
+py::object bt_to_python(Consumer& c, const std::shared_ptr<data_parts_view>& src, int depth = 0);
+py::list bt_list_to_python(bt_list_consumer& l, int depth);
+size_t bt_value_size(std::string_view s, int depth = 0);
+py::dict bt_dict_to_python(bt_dict_consumer& d, int depth);
+
+// Lazy, read-only view of a bt-encoded dict.  Nothing is decoded up front: each lookup walks the
+// encoded data (natively, without allocating) to the requested key and decodes only its value,
+// with nested dicts and lists returned as further views into the same data.  The source object is
+// referenced (not copied), so a view over a Message.dataview() part must not be used beyond the
+// message callback.
+class bt_dict_view {
+public:
+    bt_dict_view(std::shared_ptr<data_parts_view> src, std::string_view data)
+        : src_{std::move(src)}, data_{data} {
+        if (data_.empty() || data_.front() != 'd')
+            throw std::invalid_argument{"bt-encoded data is not a dict"};
+        // Check the whole structure up front so that the consumers walking it later never run off
+        // the end of truncated data.
+        if (bt_value_size(data_) != data_.size())
+            throw std::invalid_argument{"bt-encoded dict has trailing data"};
+    }
+
+    // Constructs a view of a python bytes/str/buffer object; the gil must be held.
+    static bt_dict_view from_python(py::object data) {
+        auto src = std::make_shared<data_parts_view>();
+        auto view = single_part(*src, std::move(data));
+        return {std::move(src), view};
+    }
+
+    // Returns the value of `key`, or nullopt if not present.
+    std::optional<py::object> find(std::string_view key) const {
+        bt_dict_consumer c{data_};
+        if (!c.skip_until(key))
+            return std::nullopt;
+        return bt_to_python(c, src_);
+    }
+
+    py::object get(std::string_view key) const {
+        if (auto v = find(key))
+            return std::move(*v);
+        throw py::key_error{std::string{key}};
+    }
+
+    bool contains(std::string_view key) const {
+        bt_dict_consumer c{data_};
+        return c.skip_until(key);
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (bt_dict_consumer c{data_}; !c.is_finished(); c.skip_value())
+            n++;
+        return n;
+    }
+
+    py::list keys() const {
+        py::list result;
+        for (bt_dict_consumer c{data_}; !c.is_finished(); c.skip_value())
+            result.append(py::bytes{c.key().data(), c.key().size()});
+        return result;
+    }
+
+    py::list items() const {
+        py::list result;
+        for (bt_dict_consumer c{data_}; !c.is_finished(); ) {
+            py::bytes k{c.key().data(), c.key().size()};
+            result.append(py::make_tuple(std::move(k), bt_to_python(c, src_)));
+        }
+        return result;
+    }
+
+    // Fully decodes the dict into a python dict.
+    py::dict decode() const {
+        bt_dict_consumer c{data_};
+        py::dict d;
+        while (!c.is_finished()) {
+            py::bytes k{c.key().data(), c.key().size()};
+            d[std::move(k)] = bt_to_python(c, nullptr, 1);
+        }
+        return d;
+    }
+
+    py::bytes encoded() const { return {data_.data(), data_.size()}; }
+
+    // Extracts the single view of a bytes/str/buffer value into `src`.
+    static std::string_view single_part(data_parts_view& src, py::object data) {
+        if (!PyBytes_Check(data.ptr()) && !PyUnicode_Check(data.ptr()) && !PyObject_CheckBuffer(data.ptr()))
+            throw std::invalid_argument{"bt-encoded data must be bytes, str, or a buffer"};
+        src.append(data);
+        return src.views().back();
+    }
+
+private:
+    std::shared_ptr<data_parts_view> src_;
+    std::string_view data_;
+};
+
+// Lazy, read-only view of a bt-encoded list; see bt_dict_view.  Indexing walks the encoded list up
+// to the requested element, so iterating (which decodes each element in a single pass) is preferable
+// to indexing when accessing many elements.
+class bt_list_view {
+public:
+    bt_list_view(std::shared_ptr<data_parts_view> src, std::string_view data)
+        : src_{std::move(src)}, data_{data} {
+        if (data_.empty() || data_.front() != 'l')
+            throw std::invalid_argument{"bt-encoded data is not a list"};
+        if (bt_value_size(data_) != data_.size())
+            throw std::invalid_argument{"bt-encoded list has trailing data"};
+    }
+
+    static bt_list_view from_python(py::object data) {
+        auto src = std::make_shared<data_parts_view>();
+        auto view = bt_dict_view::single_part(*src, std::move(data));
+        return {std::move(src), view};
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (bt_list_consumer c{data_}; !c.is_finished(); c.skip_value())
+            n++;
+        return n;
+    }
+
+    py::object get(py::ssize_t i) const {
+        if (i < 0)
+            i += static_cast<py::ssize_t>(size());
+        if (i >= 0) {
+            bt_list_consumer c{data_};
+            for (; i > 0 && !c.is_finished(); i--)
+                c.skip_value();
+            if (!c.is_finished())
+                return bt_to_python(c, src_);
+        }
+        throw py::index_error{"bt list index out of range"};
+    }
+
+    // Returns the elements, with nested lists and dicts as views.
+    py::list values() const {
+        py::list result;
+        for (bt_list_consumer c{data_}; !c.is_finished(); )
+            result.append(bt_to_python(c, src_));
+        return result;
+    }
+
+    // Fully decodes the list into a python list.
+    py::list decode() const {
+        py::list result;
+        for (bt_list_consumer c{data_}; !c.is_finished(); )
+            result.append(bt_to_python(c, nullptr, 1));
+        return result;
+    }
+
+    py::bytes encoded() const { return {data_.data(), data_.size()}; }
+
+private:
+    std::shared_ptr<data_parts_view> src_;
+    std::string_view data_;
+};
+
+template <typename Consumer>
+py::object bt_to_python(Consumer& c, const std::shared_ptr<data_parts_view>& src, int depth) {
+    if (c.is_string()) {
+        auto s = c.consume_string_view();
+        return py::bytes{s.data(), s.size()};
+    }
+    if (c.is_integer()) {
+        if (c.is_negative_integer())
+            return py::int_(c.template consume_integer<int64_t>());
+        return py::int_(c.template consume_integer<uint64_t>());
     }
+    if (src) {
+        if (c.is_list())
+            return py::cast(bt_list_view{src, c.consume_list_data()});
+        if (c.is_dict())
+            return py::cast(bt_dict_view{src, c.consume_dict_data()});
+    }
+    if (depth >= BT_MAX_DEPTH)
+        throw std::invalid_argument{"bt_decode: data is nested too deeply"};
+    if (c.is_list()) {
+        auto l = c.consume_list_consumer();
+        return bt_list_to_python(l, depth + 1);
+    }
+    if (c.is_dict()) {
+        auto d = c.consume_dict_consumer();
+        return bt_dict_to_python(d, depth + 1);
+    }
+    throw bt_deserialize_invalid{"bt_decode: invalid bt-encoded value"};
 }
-std::vector<std::string> extract_data_parts(py::handle obj) {
-    std::vector<std::string> parts;
-    extract_data_parts(parts, obj);
-    return parts;
+
+// Fully decodes the (remaining) elements of a list, or the items of a dict, at nesting `depth`.
+py::list bt_list_to_python(bt_list_consumer& l, int depth) {
+    py::list result;
+    while (!l.is_finished())
+        result.append(bt_to_python(l, nullptr, depth));
+    return result;
 }
 
-// Quick and dirty logger that logs to stderr.  It would be much nicer to take a python function,
-// but that deadlocks pretty much right away because of the crappiness of the gil.
-struct stderr_logger {
-    inline static std::mutex log_mutex;
+py::dict bt_dict_to_python(bt_dict_consumer& d, int depth) {
+    py::dict result;
+    while (!d.is_finished()) {
+        py::bytes k{d.key().data(), d.key().size()};
+        result[std::move(k)] = bt_to_python(d, nullptr, depth);
+    }
+    return result;
+}
 
-    void operator()(LogLevel lvl, const char* file, int line, std::string msg) {
-        std::lock_guard l{log_mutex};
-        std::cerr << '[' << lvl << "][" << file << ':' << line << "]: " << msg << "\n";
+// Returns the encoded length of the bt value at the start of `s`.  This only follows the
+// structure (string lengths, integer and container terminators); the contents are validated by
+// the consumers when decoding.
+size_t bt_value_size(std::string_view s, int depth) {
+    if (s.empty())
+        throw bt_deserialize_invalid{"truncated bt-encoded value"};
+    if (s.front() == 'i') {
+        auto e = s.find('e');
+        if (e == std::string_view::npos)
+            throw bt_deserialize_invalid{"truncated bt-encoded value"};
+        return e + 1;
     }
-};
+    if (s.front() == 'l' || s.front() == 'd') {
+        if (depth >= BT_MAX_DEPTH)
+            throw std::invalid_argument{"data is nested too deeply"};
+        for (size_t pos = 1; pos < s.size(); pos += bt_value_size(s.substr(pos), depth + 1))
+            if (s[pos] == 'e')
+                return pos + 1;
+        throw bt_deserialize_invalid{"truncated bt-encoded value"};
+    }
+    size_t len;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), len);
+    if (ec != std::errc{} || end == s.data() + s.size() || *end != ':')
+        throw bt_deserialize_invalid{"invalid bt-encoded value"};
+    size_t header = end - s.data() + 1;
+    if (len > s.size() - header)
+        throw bt_deserialize_invalid{"truncated bt-encoded value"};
+    return header + len;
+}
+
+// Fully decodes a bt-encoded python bytes/str/buffer value.  The gil must be held.
+py::object bt_decode(py::object data) {
+    data_parts_view src;
+    auto view = bt_dict_view::single_part(src, std::move(data));
+    if (view.empty())
+        throw bt_deserialize_invalid{"bt_decode: no value to decode"};
+    if (bt_value_size(view) != view.size())
+        throw bt_deserialize_invalid{"bt_decode: trailing data after the encoded value"};
+    // Containers (the usual case) are decoded by a consumer directly over the input
+    if (view.front() == 'l') {
+        bt_list_consumer l{view};
+        return bt_list_to_python(l, 1);
+    }
+    if (view.front() == 'd') {
+        bt_dict_consumer d{view};
+        return bt_dict_to_python(d, 1);
+    }
+    if (view.front() == 'i') {
+        // A consumer needs an enclosing container to read an integer from, but this is short
+        std::string wrapped;
+        wrapped.reserve(view.size() + 2);
+        wrapped += 'l';
+        wrapped += view;
+        wrapped += 'e';
+        bt_list_consumer c{wrapped};
+        return bt_to_python(c, nullptr);
+    }
+    // A string; bt_value_size() has checked its length prefix
+    auto body = view.substr(view.find(':') + 1);
+    return py::bytes{body.data(), body.size()};
+}
 
+// With pybind11 2.13+ we declare the module safe to load without the gil under free-threaded
+// CPython builds (3.13t+).  What that guarantees: the module's internal bookkeeping that oxenmq
+// threads share (stats, registries, schedulers, caches, reply batches) is guarded by a mutex or
+// atomic, and oxenmq threads only touch python objects via gil_scoped_acquire (which, under
+// free-threading, attaches a thread state rather than taking a global lock), so python command
+// handlers run in parallel across worker threads.  It does *not* make the exposed objects
+// themselves thread-safe: pybind11 adds no per-object locking, so a Message (only valid within its
+// callback), BtDict/BtList views, StreamReader iteration and, in general, any object shared between
+// python threads needs the caller's own locking.
+#if PYBIND11_VERSION_HEX >= 0x020D0000
+PYBIND11_MODULE(oxenmq, mod, py::mod_gil_not_used())
+#else
 PYBIND11_MODULE(oxenmq, mod)
+#endif
 {
     using namespace pybind11::literals;
     constexpr py::kw_only kwonly{};
@@ -161,49 +3333,45 @@ Typically the IP address string for TCP connections and "localhost:UID:GID:PID"
                 "The connection ID info for routing a reply")
         .def_readonly("access", &Message::access, py::return_value_policy::copy,
                 "The access level of the invoker (which can be higher than the access level required for the command category")
-        .def("dataview", [](const Message& m) {
-            py::list l;
-            for (auto& part : m.data)
-                l.append(py::memoryview::from_memory(part.data(), part.size()));
-            return l;
-        },
+        .def("dataview", [](const Message& m) { return to_python_parts(m.data, part_view); },
         R"(Returns a list of the data message parts as memoryviews.
 
 Note that the returned views are only valid for the duration of the callback invoked with the
 Message; if you need them beyond that then you must copy them (e.g. by calling message.data()
 or .to_bytes() on each one)"
         )
-        .def("data", [](const Message& m) {
-            py::list l;
-            for (auto& part : m.data)
-                l.append(py::bytes{part.data(), part.size()});
-            return l;
-        },
+        .def("data", [](const Message& m) { return to_python_parts(m.data, part_bytes); },
         "Returns a *copy* of the data message parts as a list of `bytes`."
         )
         .def("reply", [](Message& m, py::args args) {
-            m.send_reply(send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            send_reply_parts(m, parts.views());
         },
         R"(Sends a reply back to this caller.
 
-`args` must be bytes, str, or iterables thereof (and will be flatted).  Should only be used from a
+`args` must be bytes, str, other buffer objects (bytearray, memoryview, etc.), or iterables thereof
+(and will be flatted).  Should only be used from a
 request_command endpoint (i.e. when .is_request is true)")
         .def("back", [](Message& m, std::string command, py::args args) {
-            m.send_back(command, send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            m.send_back(command, parts.send_parts());
         },
         "command"_a,
         R"(Sends a new message (NOT a reply) to the caller.
 
 This is used to send a simple message back to the caller which is *not* specifically a request reply
 but rather is simply an endpoint to invoke on the caller who sent this message to us. `command`
-should be the command endpoint, and `response` must be none (for no data parts), bytes, str, or an
-iterable thereof.
+should be the command endpoint, and `response` must be none (for no data parts), bytes, str, other
+buffer objects, or an iterable thereof.
 
 This is a shortcut for `oxenmq.send(msg.conn, command, *args)`; use the full version if you need
 extra send functionality.)")
         .def("request", [](Message& m, std::string command, OxenMQ::ReplyCallback callback, py::args args) {
-            std::vector<std::string> data;
-            m.send_request(command, std::move(callback), send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            m.send_request(command, std::move(callback), parts.send_parts());
         },
         "command"_a, "on_reply"_a,
         R"(Sends a new request (NOT a reply) back to the remote caller.
@@ -211,7 +3379,7 @@ extra send functionality.)")
 This is used to send a new request back to the caller which is *not* specifically a request reply
 but rather is simply a new request endpoint to invoke on the caller who sent this message to us.
 `command` should be the command endpoint, and `response` must be none (for no data parts), bytes,
-str, or an iterable thereof.
+str, other buffer objects, or an iterable thereof.
 
 This is a shortcut for `oxenmq.request(msg.conn, command, on_reply, *args)`; use the full version if you need
 extra send functionality.)")
@@ -226,16 +3394,22 @@ instance is still alive).)")
         .def_property_readonly("is_request", [](const Message::DeferredSend& m) { return !m.reply_tag.empty(); },
                 "True if this message is expecting a reply (i.e. it was received on a request_command endpoint)")
         .def("reply", [](Message::DeferredSend& d, py::args args) {
-            d.reply(send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            d.reply(parts.send_parts());
         },
         "Same as Message.reply(), but deferrable")
         .def("back", [](Message::DeferredSend& d, std::string command, py::args args) {
-            d.back(command, send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            d.back(command, parts.send_parts());
         },
         "command"_a,
         "Same as Message.back(), but deferrable")
         .def("request", [](Message::DeferredSend& d, std::string command, OxenMQ::ReplyCallback callback, py::args args) {
-            d.request(command, std::move(callback), send_option::data_parts(extract_data_parts(args)));
+            data_parts_view parts{args};
+            py::gil_scoped_release no_gil;
+            d.request(command, std::move(callback), parts.send_parts());
         },
         "command"_a, "on_reply"_a,
         "Same as Message.request(), but deferrable")
@@ -246,48 +3420,312 @@ instance is still alive).)")
         "Equivalent to `reply(...)` for a request message, `back(...)` for a non-request message")
         ;
 
-    py::class_<CatHelper>(mod, "Category",
+    mod.attr("native_count_parts") = py::capsule(
+            reinterpret_cast<void*>(&oxenmq_native_count_parts), native_handler_capsule);
+
+    mod.def("bt_encode", [](py::handle value) {
+        data_parts_view refs;
+        auto bt = bt_from_python(value, refs);
+        return py::bytes{bt_serialize(bt)};
+    },
+    "value"_a,
+    R"(Encodes a value in bt-encoding (i.e. bencode, as used for oxenmq RPC payloads).
+
+bytes, str (as utf-8) and other buffer objects are encoded as strings, ints as integers (which must
+fit in a signed or unsigned 64-bit value), dicts (which must have bytes or str keys) as dicts, and
+lists, tuples and other iterables as lists.  Returns bytes.)");
+
+    mod.def("bt_decode", &bt_decode, "data"_a,
+    R"(Decodes a bt-encoded (bencoded) value from bytes, str, or a buffer (such as a memoryview from
+`Message.dataview()`).
+
+Strings are decoded as bytes, integers as int, lists as list, and dicts as dict with bytes keys.
+Raises ValueError if the data is not a single, valid bt-encoded value.
+
+To access just a few values of a large dict see `BtDict`, which decodes lazily.)");
+
+    py::class_<bt_dict_view>(mod, "BtDict",
+            R"(Lazy, read-only view of a bt-encoded dict.
+
+Constructed from bytes, str, or a buffer (such as a part of `Message.dataview()`).  Nothing is
+decoded up front: each lookup scans the encoded data natively to the requested key and decodes
+only its value.  String values are returned as bytes, integers as int, and nested dicts and lists as
+further `BtDict`/`BtList` views of the same data.  Keys may be given as bytes or str.
+
+The data is referenced rather than copied: a view over a `Message.dataview()` memoryview (including
+any nested views obtained from it) must not be used beyond the message callback.  Malformed data is
+only detected (raising ValueError) when the malformed part is accessed.)")
+        .def(py::init(&bt_dict_view::from_python), "data"_a)
+        .def("__getitem__", &bt_dict_view::get)
+        .def("get", [](const bt_dict_view& self, std::string_view key, py::object def) {
+            auto v = self.find(key);
+            return v ? std::move(*v) : def;
+        }, "key"_a, "default"_a = py::none(),
+        "Returns the value of `key`, or `default` if the dict does not contain it.")
+        .def("__contains__", &bt_dict_view::contains)
+        .def("__len__", &bt_dict_view::size)
+        .def("__iter__", [](const bt_dict_view& self) { return py::iter(self.keys()); })
+        .def("keys", &bt_dict_view::keys, "Returns a list of the dict keys (as bytes).")
+        .def("items", &bt_dict_view::items,
+                "Returns a list of (key, value) tuples; nested dicts and lists are returned as views.")
+        .def("decode", &bt_dict_view::decode, "Fully decodes the dict into a `dict`, as `bt_decode()` would.")
+        .def_property_readonly("encoded", &bt_dict_view::encoded, "The bt-encoded dict, as bytes.")
+        ;
+
+    py::class_<bt_list_view>(mod, "BtList",
+            R"(Lazy, read-only view of a bt-encoded list; see `BtDict`.
+
+Indexing scans the encoded list up to the requested element, so iterating is preferable when
+accessing many elements.)")
+        .def(py::init(&bt_list_view::from_python), "data"_a)
+        .def("__getitem__", &bt_list_view::get)
+        .def("__len__", &bt_list_view::size)
+        .def("__iter__", [](const bt_list_view& self) { return py::iter(self.values()); })
+        .def("decode", &bt_list_view::decode, "Fully decodes the list into a `list`, as `bt_decode()` would.")
+        .def_property_readonly("encoded", &bt_list_view::encoded, "The bt-encoded list, as bytes.")
+        ;
+
+    py::class_<owned_buffer>(mod, "Buffer", py::buffer_protocol(),
+            R"(Read-only buffer holding received reply data.
+
+Request replies (to `on_reply` callbacks, and from `request_future()`, `request_async()`,
+`request_many()` and completion queues) are delivered as lists of Buffers: each takes ownership of
+the received data rather than copying it, and remains valid for as long as it is referenced.
+
+A Buffer supports the buffer protocol, so it can be used anywhere a bytes-like object is accepted
+(`memoryview(buf)` gives a zero-copy view; `bytes(buf)` a copy), and compares equal to and hashes
+the same as the equivalent `bytes`.)")
+        .def_buffer([](owned_buffer& b) {
+            return py::buffer_info{b.data.data(), 1, py::format_descriptor<uint8_t>::format(), 1,
+                    {static_cast<py::ssize_t>(b.data.size())}, {py::ssize_t{1}}, /*readonly=*/true};
+        })
+        .def("__len__", [](const owned_buffer& b) { return b.data.size(); })
+        .def("__bytes__", [](const owned_buffer& b) { return py::bytes{b.data}; })
+        .def("tobytes", [](const owned_buffer& b) { return py::bytes{b.data}; }, "Returns a copy of the data as bytes")
+        .def("decode", [](const owned_buffer& b, const char* encoding, const char* errors) {
+            auto* str = PyUnicode_Decode(b.data.data(), b.data.size(), encoding, errors);
+            if (!str)
+                throw py::error_already_set{};
+            return py::reinterpret_steal<py::str>(str);
+        }, "encoding"_a = "utf-8", "errors"_a = "strict", "Decodes the data into a str, as `bytes.decode()`")
+        .def("__getitem__", [](py::object self, py::object index) -> py::object {
+            return py::memoryview(self)[std::move(index)];
+        }, "Indexes (returning an int) or slices (returning a zero-copy memoryview) the data")
+        .def("__eq__", [](const owned_buffer& b, py::handle other) -> py::object {
+            if (PyUnicode_Check(other.ptr()) || !PyObject_CheckBuffer(other.ptr()))
+                return py::reinterpret_borrow<py::object>(Py_NotImplemented);
+            data_parts_view o{other};
+            return py::bool_(o.views().front() == std::string_view{b.data});
+        })
+        // This has to be consistent with bytes, and so hashes a (temporary) bytes copy.
+        .def("__hash__", [](const owned_buffer& b) { return py::hash(py::bytes{b.data}); })
+        .def("__repr__", [](const owned_buffer& b) {
+            return "Buffer(" + std::string{py::repr(py::bytes{b.data})} + ")";
+        })
+        ;
+
+    py::class_<reply_batch>(mod, "ReplyBatch",
+            R"(Collects deferred replies to be sent together.
+
+Handlers that defer many replies (via `Message.later()`) and complete them together (e.g. when a
+backend query finishes) can `add()` each reply here and then `flush()` them all at once: the whole
+flush hands the replies off to oxenmq in a single pass with the gil released, rather than releasing
+and reacquiring the gil for each `DeferredSend.reply()` call.
+
+Data parts are not copied when added; the batch keeps references to them until it is flushed or
+cleared.)")
+        .def(py::init<>())
+        .def("add", [](reply_batch& b, const Message::DeferredSend& send, py::args args) {
+            b.add(send, args);
+        },
+        "send"_a,
+        "Queues a reply, with the given data parts, to the DeferredSend `send`")
+        .def("flush", &reply_batch::flush,
+        "Sends all queued replies and empties the batch.  Returns the number of replies sent.")
+        .def("clear", &reply_batch::clear, "Discards all queued replies without sending them.")
+        .def("__len__", &reply_batch::size)
+        ;
+
+    py::class_<batch_dispatcher, std::shared_ptr<batch_dispatcher>>(mod, "BatchDispatcher",
+            "Batched command dispatcher; returned from OxenMQ.add_batch_dispatcher(...)")
+        .def_property_readonly("max_batch", &batch_dispatcher::max_batch,
+                "The maximum number of messages dispatched under a single gil acquisition")
+        .def_property_readonly("max_latency", &batch_dispatcher::max_latency,
+                "The maximum time a message waits in the queue for its batch to fill up")
+        .def_property_readonly("messages", &batch_dispatcher::messages,
+                "The number of messages dispatched so far")
+        .def_property_readonly("batches", &batch_dispatcher::batches,
+                "The number of batches dispatched so far")
+        .def_property_readonly("queued", &batch_dispatcher::queued_messages,
+                "The number of messages currently queued waiting for dispatch")
+        ;
+
+    py::class_<connection_authorizer, std::shared_ptr<connection_authorizer>>(mod, "ConnectionAuthorizer",
+            "Cached incoming connection authorizer; returned from OxenMQ.add_connection_authorizer(...)")
+        .def_property_readonly("cache_ttl", &connection_authorizer::ttl, "How long authorizer decisions are cached")
+        .def_property_readonly("background", &connection_authorizer::background,
+                "True if the authorizer callback runs in the background on cache misses")
+        .def("invalidate", [](connection_authorizer& self, std::optional<py::bytes> pubkey, std::optional<std::string> address) {
+            self.invalidate(pubkey ? std::optional<std::string>{std::string(*pubkey)} : std::nullopt, address);
+        },
+        kwonly, "pubkey"_a = std::nullopt, "address"_a = std::nullopt,
+        R"(Drops cached decisions for the given `pubkey` and/or remote `address`, or all cached
+decisions if neither is given.  Decisions that are being made when this is called are not cached.)")
+        .def("allow", [](connection_authorizer& self, py::bytes pubkey, AuthLevel level) { self.allow(checked_pubkey(pubkey), level); },
+                "pubkey"_a, "level"_a = AuthLevel::none,
+                "Adds `pubkey` to the static allow set with the given access level (removing it from the deny set)")
+        .def("deny", [](connection_authorizer& self, py::bytes pubkey) { self.deny(checked_pubkey(pubkey)); },
+                "pubkey"_a, "Adds `pubkey` to the static deny set (removing it from the allow set)")
+        .def("forget", [](connection_authorizer& self, py::bytes pubkey) { self.forget(checked_pubkey(pubkey)); },
+                "pubkey"_a, "Removes `pubkey` from the static allow and deny sets")
+        .def("stats", &connection_authorizer::stats,
+                R"(Returns a dict of authorization counts: `hits` (cached decisions), `static_hits` (allow/deny
+set decisions), and `misses`, plus the current number of `pending` background decisions and cached
+`entries`.)")
+        ;
+
+    py::class_<priority_scheduler, std::shared_ptr<priority_scheduler>>(mod, "PriorityScheduler",
+            "Priority-ordered command dispatcher; returned from OxenMQ.add_priority_scheduler(...)")
+        .def_property_readonly("threads", &priority_scheduler::threads,
+                "The number of threads dispatching commands")
+        .def_property_readonly("aging", &priority_scheduler::aging,
+                "The waiting time that raises a queued command's effective priority by one")
+        .def_property_readonly("queued", &priority_scheduler::queued_messages,
+                "The number of commands currently queued waiting for dispatch")
+        .def_property_readonly("max_queue", &priority_scheduler::max_queue,
+                "The maximum number of queued commands (0 if unlimited)")
+        .def_property_readonly("dropped", &priority_scheduler::dropped,
+                "The number of commands dropped because the queue was full")
+        .def("stats", &priority_scheduler::stats,
+                R"(Returns a dict of priority to a dict of that priority's `dispatched`, `queued` and
+`dropped` command counts, and its `wait` histogram of the time commands spent queued (in the same format as
+the histograms of `OxenMQ.stats()`).)")
+        ;
+
+    py::class_<stream_reader, std::shared_ptr<stream_reader>>(mod, "StreamReader",
+            R"(Incoming stream passed to a stream command handler; see Category.add_stream_command().
+
+Iterating (with `for` or `async for`) yields the stream's data chunks as `bytes`, in order, ending
+when the sender finishes the stream.  Each chunk is only acknowledged to the sender once it has been
+yielded, so a slow consumer slows down the sender rather than accumulating data.  Iteration raises
+RuntimeError if the stream is aborted by the sender or times out.)")
+        .def_property_readonly("conn", &stream_reader::conn, "The ConnectionID of the sender")
+        .def_property_readonly("bytes_received", &stream_reader::bytes_received,
+                "The number of data bytes received so far (including chunks not yet consumed)")
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", [](stream_reader& r) {
+            stream_reader::next_result result;
+            {
+                py::gil_scoped_release no_gil;
+                result = r.next();
+            }
+            auto [value, exception] = stream_reader::to_python(std::move(result), false);
+            if (exception) {
+                PyErr_SetObject(reinterpret_cast<PyObject*>(Py_TYPE(value.ptr())), value.ptr());
+                throw py::error_already_set{};
+            }
+            return value;
+        },
+        "Returns the next chunk, blocking (without holding the gil) until it arrives.")
+        .def("__aiter__", [](py::object self) { return self; })
+        .def("__anext__", &stream_reader::anext,
+        "Returns an awaitable for the next chunk; must be called from within an asyncio event loop.")
+        .def("close", &stream_reader::close,
+        "Abandons the stream: remaining chunks are rejected, which makes the sender's stream_send fail.")
+        ;
+
+    py::class_<category_helper>(mod, "Category",
             "Helper class to add in registering category commands, returned from OxenMQ.add_category(...)")
-        .def("add_command", [](CatHelper& cat, std::string name, py::function cb) {
-            return cat.add_command(name, [cb=std::move(cb)](Message& m) {
-                py::gil_scoped_acquire gil;
-                cb(&m);
-            });
+        .def("add_command", [](category_helper& cat, std::string name, py::function cb,
+                    std::shared_ptr<batch_dispatcher> dispatcher, bool parts_tuple, std::optional<int> priority,
+                    std::shared_ptr<compression_config> compression) {
+            auto stats = cat.stats_for(name);
+            std::function<void(Message&)> callback;
+            if (auto [sched, prio] = cat.scheduling(dispatcher, priority); sched)
+                callback = [sched = sched, prio = prio, stats, parts_tuple,
+                        cb=make_shared_pyobject(std::move(cb))](Message& m) {
+                    sched->queue(m, cb, stats, false, parts_tuple, prio);
+                };
+            else if (dispatcher)
+                callback = [dispatcher, stats, parts_tuple, cb=make_shared_pyobject(std::move(cb))](Message& m) {
+                    dispatcher->queue(m, cb, stats, false, parts_tuple);
+                };
+            else
+                callback = [stats, parts_tuple, cb=make_shared_pyobject(std::move(cb))](Message& m) {
+                    command_stats::call call{*stats};
+                    py::gil_scoped_acquire gil;
+                    call.started();
+                    invoke_handler(*cb, m, parts_tuple);
+                };
+            if (compression)
+                callback = accept_compressed(std::move(callback), std::move(compression), cat.omq.stats);
+            else
+                callback = refuse_compressed(std::move(callback), cat.omq.stats);
+            cat.cat.add_command(name, std::move(callback));
+            return &cat;
         },
-        "name"_a, "callback"_a,
+        "name"_a, "callback"_a, kwonly, "dispatcher"_a = nullptr, "parts_tuple"_a = false,
+        "priority"_a = std::nullopt, "compression"_a = nullptr,
         R"(Add a command handler to this category.
 
 Adds a command, that is a command that is typically some sort of instruction that requires no reply.
 (For a more typically request-response interface use .add_request_command instead).
 
 The callback is passed a `Message` object containing details of the received message.  Note that
-this object must *not* be stored beyond the callback itself; see `Message` for details.)")
+this object must *not* be stored beyond the callback itself; see `Message` for details.
+
+If `dispatcher` is given (a BatchDispatcher returned by `OxenMQ.add_batch_dispatcher()`) then
+incoming messages are queued and the callback is invoked from the dispatcher's thread in batches
+rather than directly from a worker thread.
+
+If `parts_tuple` is True then the callback is invoked with a second argument: a tuple of the
+message data parts as bytes.  This is equivalent to (but cheaper than) calling `message.data()`: the
+tuple is allocated once at its final size, so each message costs exactly one Message wrapper, one
+tuple and one bytes object per part.
+
+If the category was added with a `scheduler` then the callback is invoked from the scheduler's
+threads in priority order; `priority` overrides the category's default priority for this command.
+
+If `compression` (a `Compression`) is given then the command also accepts payloads sent with the
+`compression` send option: they are decompressed on the worker thread, without the gil, before the
+callback is invoked.  Uncompressed messages (e.g. from peers not using compression) are still
+accepted as usual.)")
         .def("add_request_command",
-                [](CatHelper& cat,
+                [](category_helper& cat,
                     std::string name,
-                    std::function<py::object(Message* msg)> handler)
+                    py::function handler,
+                    std::shared_ptr<batch_dispatcher> dispatcher,
+                    bool parts_tuple,
+                    std::optional<int> priority,
+                    std::shared_ptr<compression_config> compression)
                 {
-                    cat.add_request_command(name, [handler](Message& msg) {
-                        std::vector<std::string> result;
-                        {
+                    auto stats = cat.stats_for(name);
+                    std::function<void(Message&)> callback;
+                    if (auto [sched, prio] = cat.scheduling(dispatcher, priority); sched)
+                        callback = [sched = sched, prio = prio, stats, parts_tuple,
+                                handler=make_shared_pyobject(std::move(handler))](Message& msg) {
+                            sched->queue(msg, handler, stats, true, parts_tuple, prio);
+                        };
+                    else if (dispatcher)
+                        callback = [dispatcher, stats, parts_tuple, handler=make_shared_pyobject(std::move(handler))](Message& msg) {
+                            dispatcher->queue(msg, handler, stats, true, parts_tuple);
+                        };
+                    else
+                        callback = [stats, parts_tuple, handler=make_shared_pyobject(std::move(handler))](Message& msg) {
+                            command_stats::call call{*stats};
                             py::gil_scoped_acquire gil;
-
-                            py::object obj = handler(&msg);
-                            if (obj.is_none())
-                                return;
-                            try {
-                                result = extract_data_parts(obj);
-                            } catch (const std::exception& e) {
-                                msg.oxenmq.log(LogLevel::warn, __FILE__, __LINE__,
-                                        "Python callback returned "s + e.what());
-                                return;
-                            }
-                        }
-                        msg.send_reply(send_option::data_parts(result));
-                    });
+                            call.started();
+                            send_python_reply(msg, invoke_handler(*handler, msg, parts_tuple));
+                        };
+                    if (compression)
+                        callback = accept_compressed(std::move(callback), std::move(compression), cat.omq.stats);
+                    else
+                        callback = refuse_compressed(std::move(callback), cat.omq.stats);
+                    cat.cat.add_request_command(name, std::move(callback));
                     return &cat;
                 },
-                "name"_a, "handler"_a,
+                "name"_a, "handler"_a, kwonly, "dispatcher"_a = nullptr, "parts_tuple"_a = false,
+                "priority"_a = std::nullopt, "compression"_a = nullptr,
                 R"(Add a request command to this category.
 
 Adds a request command, that is, a command that is always expected to reply, to this category.  The
@@ -298,32 +3736,367 @@ of:
   Message.reply()), or because you want to send it later via Message.later().
 - bytes - will be sent as is in a single-part reply.
 - str - will be sent in utf-8 encoding in a single-part reply.
-- iterable object containing bytes and/or str elements: will be sent as a multi-part reply where
-  each part is sent as-is (bytes) or utf8-encoded (str).
+- any other object supporting the contiguous buffer protocol (bytearray, memoryview, etc.) - the
+  buffer contents will be sent as is in a single-part reply.
+- iterable object containing bytes, str, and/or buffer elements: will be sent as a multi-part reply
+  where each part is sent as-is (bytes/buffers) or utf8-encoded (str).
 
 The callback also must take care not to save the provided `Message` value beyond the end of the
-callback itself.)")
+callback itself.
+
+If `dispatcher` is given then the handler is invoked in batches from the dispatcher's thread, and if
+`parts_tuple` is True then it is also passed a tuple of the data parts, and `priority` overrides the
+category's default priority if the category has a scheduler; see `add_command()`.
+
+If `compression` (a `Compression`) is given then compressed requests are accepted (see
+`add_command()`), and the handler's reply (its return value, or a `Message.reply()` from within the
+handler) is compressed with it if the request was made with the `compression` option: that is, if
+the requester has said that it can decompress replies.  Replies are compressed without the gil,
+and only when they reach the compression threshold.  Replies sent later (via `Message.later()`)
+or from a dispatcher or scheduler thread are sent uncompressed.)")
+        .def("add_static_request_command", [](category_helper& cat, std::string name, py::args args) {
+            data_parts_view parts{args};
+            auto reply = std::make_shared<const std::vector<std::string>>(parts.views().begin(), parts.views().end());
+            cat.cat.add_request_command(name, [stats=cat.stats_for(name), reply=std::move(reply)](Message& msg) {
+                command_stats::call call{*stats};
+                msg.send_reply(send_option::data_parts(*reply));
+            });
+            return &cat;
+        },
+        "name"_a,
+        R"(Adds a request command that always replies with the given fixed data parts.
+
+The reply is sent directly from the oxenmq worker thread without involving python (or the gil) at
+all, making this suitable for liveness checks and other static (e.g. version) endpoints.  `args` are
+the reply data parts, as for `Message.reply()`, and are copied when registering the command.)")
+        .def("add_echo_request_command", [](category_helper& cat, std::string name, py::args prefix) {
+            data_parts_view parts{prefix};
+            auto pre = std::make_shared<const std::vector<std::string>>(parts.views().begin(), parts.views().end());
+            cat.cat.add_request_command(name, refuse_compressed([stats=cat.stats_for(name), pre=std::move(pre)](Message& msg) {
+                command_stats::call call{*stats};
+                std::vector<std::string_view> reply{pre->begin(), pre->end()};
+                reply.insert(reply.end(), msg.data.begin(), msg.data.end());
+                msg.send_reply(send_option::data_parts(reply));
+            }, cat.omq.stats));
+            return &cat;
+        },
+        "name"_a,
+        R"(Adds a request command that replies with the request's own data parts.
+
+Any given `prefix` arguments are prepended as extra reply parts.  As with
+`add_static_request_command()` the reply is sent without involving python.)")
+        .def("add_native_command", [](category_helper& cat, std::string name, py::object handler) {
+            auto fn = native_handler_ptr(handler);
+            cat.cat.add_command(name, refuse_compressed([fn, stats=cat.stats_for(name),
+                    keepalive=make_shared_pyobject(std::move(handler))](Message& m) {
+                command_stats::call call{*stats};
+                invoke_native_handler(fn, m, false);
+            }, cat.omq.stats));
+            return &cat;
+        },
+        "name"_a, "handler"_a,
+        R"(Adds a command implemented by a native C function.
+
+The function is invoked directly on the oxenmq worker thread *without* the gil; it must not touch
+python objects.  `handler` may be a ctypes function pointer (e.g. a function of a ctypes.CDLL), an
+int function address, or a PyCapsule named "oxenmq.native_handler" wrapping the function pointer.
+It must have the C signature:
+
+    int handler(const char* const* parts, const size_t* lengths, size_t n_parts,
+                void (*append)(void* reply_ctx, const char* data, size_t length), void* reply_ctx);
+
+where `parts`/`lengths` give the `n_parts` message data parts.  For a command (as opposed to a
+request command) `append` and `reply_ctx` are NULL and the return value is ignored.  A reference to
+`handler` is held for the lifetime of the OxenMQ object.
+
+Note that a ctypes CFUNCTYPE wrapping a *python* function is not native: calling it takes the gil.
+`oxenmq.native_count_parts` is a trivial built-in handler (replying with the number of parts).)")
+        .def("add_native_request_command", [](category_helper& cat, std::string name, py::object handler) {
+            auto fn = native_handler_ptr(handler);
+            cat.cat.add_request_command(name, refuse_compressed([fn, stats=cat.stats_for(name),
+                    keepalive=make_shared_pyobject(std::move(handler))](Message& m) {
+                command_stats::call call{*stats};
+                if (auto reply = invoke_native_handler(fn, m, true))
+                    m.send_reply(send_option::data_parts(*reply));
+            }, cat.omq.stats));
+            return &cat;
+        },
+        "name"_a, "handler"_a,
+        R"(Adds a request command implemented by a native C function.
+
+As `add_native_command()`, except that the handler builds the reply by calling
+`append(reply_ctx, data, length)` once for each reply part, and then returns 0 to send the reply or
+non-zero to send no reply.)")
+        .def("add_pubsub_commands", [](category_helper& cat, std::string subscribe, std::string unsubscribe,
+                    std::chrono::milliseconds ttl, std::optional<std::vector<std::string>> topics, size_t max_topics) {
+            std::shared_ptr<std::unordered_set<std::string>> allowed;
+            if (topics)
+                allowed = std::make_shared<std::unordered_set<std::string>>(topics->begin(), topics->end());
+            auto check = [allowed](Message& m, size_t parts) {
+                if (m.data.size() != parts) {
+                    m.send_reply("BAD_REQUEST");
+                    return false;
+                }
+                if (allowed && !allowed->count(std::string{m.data[0]})) {
+                    m.send_reply("UNKNOWN_TOPIC");
+                    return false;
+                }
+                return true;
+            };
+            cat.cat.add_request_command(subscribe, refuse_compressed(
+                    [check, ttl, max_topics, pubsub=cat.omq.pubsub, stats=cat.stats_for(subscribe)](Message& m) {
+                command_stats::call call{*stats};
+                if (!check(m, 2))
+                    return;
+                if (!pubsub->subscribe(std::string{m.data[0]}, m.conn, std::string{m.data[1]}, ttl, max_topics))
+                    m.send_reply("TOO_MANY_TOPICS");
+                else
+                    m.send_reply("OK", std::to_string(ttl.count() / 1000));
+            }, cat.omq.stats));
+            cat.cat.add_request_command(unsubscribe, refuse_compressed(
+                    [check, pubsub=cat.omq.pubsub, stats=cat.stats_for(unsubscribe)](Message& m) {
+                command_stats::call call{*stats};
+                if (!check(m, 1))
+                    return;
+                m.send_reply(pubsub->unsubscribe(std::string{m.data[0]}, m.conn) ? "OK" : "NOT_SUBSCRIBED");
+            }, cat.omq.stats));
+            return &cat;
+        },
+        "subscribe"_a = "subscribe", "unsubscribe"_a = "unsubscribe", kwonly,
+        "ttl"_a = 30min, "topics"_a = std::nullopt, "max_topics"_a = 1000,
+        R"(Adds subscribe and unsubscribe request commands for OxenMQ.publish() topics.
+
+These are handled entirely natively (without acquiring the gil).
+
+A remote subscribes by sending a `subscribe` request with two data parts: the topic and the command
+(e.g. `notify.block`) on which it wants to receive publications.  The reply is `OK` and the
+subscription ttl in seconds; the remote must re-subscribe before the ttl expires to keep receiving
+publications.  A `unsubscribe` request with the topic as its single data part removes the
+subscription, replying `OK` or `NOT_SUBSCRIBED`.
+
+Parameters:
+
+- subscribe -- the subscribe command name (default "subscribe")
+- unsubscribe -- the unsubscribe command name (default "unsubscribe")
+- ttl -- the subscription lifetime (default 30 minutes)
+- topics -- if given, a list of the allowed topics; requests for other topics are replied to with
+  `UNKNOWN_TOPIC`.  Malformed requests get a `BAD_REQUEST` reply.
+- max_topics -- the maximum number of distinct topics with live subscriptions (default 1000; 0 for
+  no limit).  Without a `topics` allow-list any remote can subscribe to arbitrary topic names, so
+  this bounds the memory they can consume: a subscription that would create a topic beyond the
+  limit is replied to with `TOO_MANY_TOPICS`.  The limit counts all topics of this OxenMQ instance,
+  including those subscribed locally or via other subscribe commands.)")
+        .def("add_stream_command", [](category_helper& cat, std::string name, py::function handler,
+                    std::chrono::milliseconds timeout, uint64_t max_window) {
+            if (max_window == 0)
+                throw std::invalid_argument{"add_stream_command: max_window must be positive"};
+            auto registry = std::make_shared<stream_registry>();
+            cat.cat.add_request_command(name, refuse_compressed([registry, timeout, max_window, stats=cat.stats_for(name),
+                    handler=make_shared_pyobject(std::move(handler)), &omq=cat.omq](Message& m) {
+                command_stats::call call{*stats};
+                uint64_t seq, window;
+                if (m.data.size() != 5 || m.data[2].size() != 1 ||
+                        std::from_chars(m.data[1].data(), m.data[1].data() + m.data[1].size(), seq).ec != std::errc{} ||
+                        std::from_chars(m.data[4].data(), m.data[4].data() + m.data[4].size(), window).ec != std::errc{} ||
+                        window == 0) {
+                    m.send_reply("BAD_REQUEST");
+                    return;
+                }
+                if (window > max_window) {
+                    m.send_reply("WINDOW_TOO_LARGE");
+                    return;
+                }
+                char kind = m.data[2][0];
+                auto [reader, created] = registry->get(omq, m.conn, m.data[0], kind != 'a', timeout, window);
+                if (!reader) {
+                    m.send_reply("OK");
+                    return;
+                }
+                reader->deliver(seq, kind, m.data[3], m.send_later());
+                if (created) {
+                    py::gil_scoped_acquire gil;
+                    call.started();
+                    try {
+                        (*handler)(reader);
+                    } catch (const std::exception& e) {
+                        omq.log(LogLevel::warn, __FILE__, __LINE__, "Stream command handler raised: ", e.what());
+                        reader->close();
+                    }
+                }
+            }, cat.omq.stats));
+            return &cat;
+        },
+        "name"_a, "handler"_a, kwonly, "timeout"_a = 60s, "max_window"_a = 64,
+        R"(Adds a command that receives streams sent with `OxenMQ.stream_send()`.
+
+When a new stream arrives, `handler` is invoked with a StreamReader from which the stream's data
+chunks can be read, incrementally, as they arrive.  The handler is invoked from an OxenMQ worker
+thread and, since the stream's chunks are themselves delivered via worker threads, it must *not*
+consume the stream itself: instead it should hand the reader off to something else, for instance a
+thread or an asyncio task:
+
+    def on_stream(reader):
+        threading.Thread(target=save_snapshot, args=(reader,)).start()
+
+    def on_stream_async(reader):
+        loop.call_soon_threadsafe(lambda: loop.create_task(save_snapshot_async(reader)))
+
+If the handler raises an exception then the stream is closed.
+
+Chunks are only acknowledged to the sender once consumed from the reader, and the sender only
+keeps a limited window of unacknowledged chunks in flight, so memory use on both sides is bounded
+by the window rather than the total stream size.  The receiver enforces this: streams sent with a
+`window` larger than `max_window` (default 64) are refused, and a chunk sent beyond the window fails
+the stream.  Chunks that were already received are rejected without affecting the stream.
+
+`timeout` is how long a reader waits for the next chunk before failing the stream (default 60s).)")
                 ;
 
+    py::class_<compression_config, std::shared_ptr<compression_config>>(mod, "Compression",
+            R"(Payload compression settings, for the `compression` option of commands and of send/request.
+
+Compression is opt-in on both ends: only commands added with `compression=` accept compressed
+messages, and a request command only compresses its reply if the request was sent with
+`compression=` (which tells it that the requester can decompress it).  Peers and commands that
+don't use compression at all keep working unchanged.
+
+A compressed request that the receiver can't handle (because the command was added without
+`compression=`, or the message uses a different dictionary, is too large, or is corrupt) fails with
+a RuntimeError whose message includes `COMPRESSION_ERROR` and the reason, rather than being handed
+to the command.  From then on messages to that command on that connection are sent uncompressed, so
+simply retrying the request succeeds.  Plain messages (not requests) get no reply, and so can't be
+rejected in the same way: they are sent uncompressed until a compressed request to the same command
+on the same connection has succeeded, or `OxenMQ.set_compression_supported()` says that it accepts
+compression.  (Remotes not using this python module, or older versions of it, don't know about
+compression at all and will pass compressed requests to the command as-is).
+
+Compression and decompression run on oxenmq threads (or with the gil released), and only for
+messages whose data parts total at least `threshold` bytes; messages that don't compress are sent
+as is.  The amount of compression achieved is reported in `OxenMQ.stats()`.)")
+        .def(py::init([](std::string_view algorithm, std::optional<int> level, size_t threshold,
+                        std::optional<py::bytes> dictionary, size_t max_size) {
+                    return std::make_shared<compression_config>(algorithm, level, threshold,
+                            dictionary ? std::string(*dictionary) : ""s, max_size);
+                }),
+                "algorithm"_a = "zstd", kwonly, "level"_a = std::nullopt, "threshold"_a = 1024,
+                "dictionary"_a = std::nullopt, "max_size"_a = 64 * 1024 * 1024,
+                R"(Constructs compression settings.
+
+- algorithm - "zstd" (the default) or "lz4", which compresses less but is considerably faster.
+
+- level - the zstd compression level (default 3), or the lz4 acceleration factor (default 1; higher
+  values are faster but compress less).
+
+- threshold - the minimum total size of a message's data for it to be compressed (default 1024).
+
+- dictionary - an optional compression dictionary (e.g. as trained by `zstd --train` on sample
+  messages), which greatly improves the compression of small messages.  Both ends must use the same
+  dictionary: a message compressed with a different dictionary is rejected.  If a reply would use
+  a dictionary that the requester doesn't have then it is compressed without one.
+
+- max_size - the maximum decompressed size accepted; larger messages are rejected, which protects
+  against "decompression bombs".  Defaults to 64MiB.)")
+        .def_property_readonly("algorithm", &compression_config::algorithm, "The compression algorithm")
+        .def_readonly("level", &compression_config::level, "The compression level (or lz4 acceleration)")
+        .def_readonly("threshold", &compression_config::threshold, "The minimum data size compressed")
+        .def_readonly("max_size", &compression_config::max_size, "The maximum decompressed size accepted")
+        ;
+
+    py::class_<completion_queue, std::shared_ptr<completion_queue>>(mod, "CompletionQueue",
+            R"(Collects the results of many outstanding requests for bulk retrieval.
+
+Requests sent with `completion_queue=q` (and optionally `tag=...` to identify them) deliver their
+results into the queue rather than to callbacks or futures.  Results are retrieved in bulk with
+`drain()`, and the queue's file descriptor (`fileno()`) is readable whenever results are waiting, so
+it can be used with select/poll/epoll or asyncio's `loop.add_reader()`:
+
+    q = CompletionQueue()
+    for i, conn in enumerate(conns):
+        omq.request(conn, "rpc.get_info", completion_queue=q, tag=i)
+    loop.add_reader(q.fileno(), lambda: handle_results(q.drain()))
+
+This avoids both the per-request gil acquisition of on_reply callbacks and having to poll each of
+many outstanding futures.)")
+        .def(py::init<>())
+        .def("fileno", &completion_queue::fileno,
+                R"(Returns a file descriptor that is readable whenever the queue is not empty.
+
+The descriptor is owned by the queue and must not be read from or closed.  (It is an eventfd on
+Linux and the read end of a pipe elsewhere).)")
+        .def("drain", &completion_queue::drain, "max_n"_a = std::nullopt,
+                R"(Removes and returns up to `max_n` (default: all) completed requests.
+
+Returns a list of `(tag, result)` tuples in completion order, where `tag` is the tag given when
+sending the request (None if not given) and `result` is a list of `Buffer` reply parts for a
+successful request, or a TimeoutError or RuntimeError instance (not raised) for a failed request.)")
+        .def("wait", &completion_queue::wait, "timeout"_a = std::nullopt,
+                py::call_guard<py::gil_scoped_release>(),
+                R"(Blocks until at least one completed request is available, or until the (optional)
+timeout expires.  Returns True if results are available, False on timeout.  The gil is released
+while waiting.)")
+        .def("__len__", &completion_queue::size)
+        ;
+
+    py::class_<send_template>(mod, "SendTemplate",
+            "Prepared send of a command with fixed options; returned by OxenMQ.prepare_send(...)")
+        .def("__call__", [](send_template& t, std::variant<ConnectionID, py::bytes> to, py::args args) {
+            t.options.send(t.omq, connection_id(std::move(to)), t.command, data_parts_view{args});
+        },
+        "conn"_a,
+        "Sends the prepared command to `conn` with the given data parts.")
+        .def_readonly("command", &send_template::command, "The prepared command")
+        .def_property_readonly("request", [](const send_template& t) { return t.options.request; },
+                "True if this template sends requests")
+        ;
+
     py::enum_<LogLevel>(mod, "LogLevel")
         .value("fatal", LogLevel::fatal).value("error", LogLevel::error).value("warn", LogLevel::warn)
         .value("info", LogLevel::info).value("debug", LogLevel::debug).value("trace", LogLevel::trace);
 
-    py::class_<OxenMQ> oxenmq{mod, "OxenMQ"};
+    py::class_<PyOxenMQ, omq_holder> oxenmq{mod, "OxenMQ"};
     oxenmq
         .def(py::init([](
                         py::bytes pubkey,
                         py::bytes privkey,
                         bool sn,
                         OxenMQ::SNRemoteAddress sn_lookup,
-                        std::optional<LogLevel> log_level) {
-            return std::make_unique<OxenMQ>(pubkey, privkey, sn, std::move(sn_lookup),
-                    log_level ? OxenMQ::Logger{stderr_logger{}} : nullptr,
-                    log_level.value_or(LogLevel::warn));
+                        std::optional<LogLevel> log_level,
+                        bool python_logging,
+                        size_t log_queue_size,
+                        std::chrono::milliseconds log_drain_interval) {
+            // The native address table is consulted first, so that python (and the gil) is only
+            // involved for pubkeys that aren't in it.
+            auto addresses = std::make_shared<sn_address_table>();
+            OxenMQ::SNRemoteAddress lookup = [addresses, sn_lookup=std::move(sn_lookup)](std::string_view pubkey) {
+                auto addr = addresses->find(pubkey);
+                if (addr.empty() && sn_lookup)
+                    addr = sn_lookup(pubkey);
+                return addr;
+            };
+
+            if (!python_logging) {
+                omq_holder omq{new PyOxenMQ(pubkey, privkey, sn, std::move(lookup),
+                        log_level ? OxenMQ::Logger{stderr_logger{}} : nullptr,
+                        log_level.value_or(LogLevel::warn))};
+                omq->sn_addresses = std::move(addresses);
+                return omq;
+            }
+
+            auto ring = std::make_shared<log_ring>(log_queue_size);
+            omq_holder omq{new PyOxenMQ(pubkey, privkey, sn, std::move(lookup),
+                    ring_logger{ring}, log_level.value_or(LogLevel::warn))};
+            omq->sn_addresses = std::move(addresses);
+            omq->log_queue = ring;
+            omq->add_timer([ring, reported = uint64_t{0}]() mutable {
+                py::gil_scoped_acquire gil;
+                drain_log_ring(*ring, reported);
+            }, log_drain_interval);
+            return omq;
         }),
                 kwonly,
                 "pubkey"_a = py::bytes(), "privkey"_a = py::bytes(), "service_node"_a = false,
                 "sn_lookup"_a = py::none(), "log_level"_a = py::none(),
+                "python_logging"_a = false, "log_queue_size"_a = 4096, "log_drain_interval"_a = 100ms,
                 R"(OxenMQ constructor.
 
 This constructs the object but does not start it; you will typically want to first add categories
@@ -348,11 +4121,21 @@ Parameters:
   and that the function is never called for a connection to self (that uses an internal connection
   instead).  Also note that the service node must be listening in curve25519 mode (otherwise we
   couldn't verify its authenticity).  Should return empty for not found or if SN lookups are not
-  supported.  If omitted a stub function is used that always returns empty.
+  supported.  If omitted a stub function is used that always returns empty.  Addresses loaded with
+  `set_sn_addresses()`/`update_sn_addresses()` take precedence: this function (which is invoked
+  from the proxy thread, and must acquire the gil) is only called for pubkeys not in that table.
 
 - log_level the initial log level; defaults to warn.  The log level can be changed later by calling
-  log_level(...).  Note that currently all logging goes directly to stderr because of obstacles with
-  Python's GIL.  In the future a Python callback may be supported for log messages.
+  log_level(...).  Unless python_logging is enabled, logging is only enabled if this is given, and
+  goes directly to stderr.
+
+- python_logging - if True then log messages are delivered to python's `logging` module (via the
+  "oxenmq" logger) rather than to stderr.  OxenMQ threads never call into python to log: instead they
+  push records into a bounded, lock-free queue of `log_queue_size` records that is drained into
+  `logging` every `log_drain_interval` by a timer job running in the batch job queue (and so only
+  once `start()` has been called).  If the queue fills up then new records are dropped and counted
+  (see `log_dropped`), and a warning reporting the number of dropped records is logged.  oxenmq's
+  `trace` level maps to python log level 5 (below logging.DEBUG).
 )")
 
         .def_readwrite("handshake_time", &OxenMQ::HANDSHAKE_TIME,
@@ -410,18 +4193,110 @@ This primarily affects any new ipc:// listening sockets that get created.  Does
 `start()`, so may affect other threads that create files/directories at the same time as the start()
 call.)")
         .def_property_readonly("pubkey",
-                [](const OxenMQ& self) {
+                [](const PyOxenMQ& self) {
                     auto& pub = self.get_pubkey();
                     return py::bytes(pub.data(), pub.size());
                 },
                 "Accesses this OxenMQ's x25519 public key, as bytes.")
         .def_property_readonly("privkey",
-                [](const OxenMQ& self) {
+                [](const PyOxenMQ& self) {
                     auto& priv = self.get_privkey();
                     return py::bytes(priv.data(), priv.size());
                 },
                 "Accesses this OxenMQ's x25519 private key, as bytes.")
-        .def("start", &OxenMQ::start, R"(Starts the OxenMQ object.
+        .def_property_readonly("log_dropped",
+                [](const PyOxenMQ& self) { return self.log_queue ? self.log_queue->dropped() : 0; },
+                "The number of log messages dropped because the python_logging queue was full.")
+        .def("stats", [](PyOxenMQ& self) {
+            std::vector<std::pair<std::string, std::shared_ptr<command_stats>>> commands;
+            {
+                std::lock_guard lock{self.stats->mutex};
+                commands.assign(self.stats->commands.begin(), self.stats->commands.end());
+            }
+            py::dict cmds, cats;
+            for (auto& [name, st] : commands) {
+                auto snap = st->snapshot();
+                auto cat = py::str(name.substr(0, name.find('.')));
+                if (!cats.contains(cat))
+                    cats[cat] = py::dict{"invocations"_a = 0, "errors"_a = 0, "in_progress"_a = 0};
+                py::dict c = cats[cat];
+                for (auto field : {"invocations", "errors", "in_progress"})
+                    c[field] = c[field] + snap[field];
+                cmds[py::str(name)] = std::move(snap);
+            }
+            auto& st = *self.stats;
+            auto load = [](const std::atomic<uint64_t>& a) { return a.load(std::memory_order_relaxed); };
+            // The two sizes are separate relaxed counters, so a snapshot taken while a message is
+            // being counted can briefly see the compressed size ahead of the raw size; clamp rather
+            // than wrap around.
+            auto compressed_raw = load(st.compressed_raw_bytes), compressed = load(st.compressed_bytes);
+            return py::dict{
+                "commands"_a = cmds,
+                "categories"_a = cats,
+                "messages_sent"_a = load(st.messages_sent),
+                "requests_sent"_a = load(st.requests_sent),
+                "replies"_a = load(st.replies),
+                "reply_failures"_a = load(st.reply_failures),
+                "reply_timeouts"_a = load(st.reply_timeouts),
+                "request_latency"_a = st.request_latency.snapshot(),
+                "queue_full"_a = load(st.queue_full),
+                "queue_failures"_a = load(st.queue_failures),
+                "log_dropped"_a = self.log_queue ? self.log_queue->dropped() : 0,
+                "coalescing"_a = self.coalescer->snapshot(),
+                "compression"_a = py::dict{
+                    "compressed"_a = load(st.compressed),
+                    "compressed_raw_bytes"_a = compressed_raw,
+                    "compressed_bytes"_a = compressed,
+                    "bytes_saved"_a = compressed_raw > compressed ? compressed_raw - compressed : 0,
+                    "uncompressed"_a = load(st.uncompressed),
+                    "decompressed"_a = load(st.decompressed),
+                    "decompressed_bytes"_a = load(st.decompressed_bytes),
+                    "decompressed_raw_bytes"_a = load(st.decompressed_raw_bytes),
+                    "failures"_a = load(st.decompress_failures),
+                    "rejected"_a = load(st.compression_rejected)}};
+        },
+        R"(Returns a snapshot of this OxenMQ's statistics as a dict.
+
+The statistics are maintained with atomic counters and lock-free histograms on the worker and proxy
+threads, and the snapshot is cheap enough to be taken every second or so.  The returned dict
+contains:
+
+- commands - dict of "category.command" to a dict of that command's statistics: `invocations`,
+  `errors` (handlers that raised), `in_progress` (currently executing), and `queue_wait` and
+  `handler_time` latency histograms.  `queue_wait` is the time between the command being handed to
+  the wrapper by oxenmq and the handler starting: that is, time spent waiting for the gil and (for
+  commands using a BatchDispatcher) in the dispatcher queue.  Time spent in oxenmq's own internal
+  category queues (see `max_queue`) is not visible to the wrapper.
+
+- categories - dict of category name to the `invocations`, `errors`, and `in_progress` totals of
+  its commands.
+
+- messages_sent, requests_sent - messages and requests sent via send/request and related methods.
+
+- replies, reply_failures, reply_timeouts - the outcomes of sent requests.
+
+- request_latency - latency histogram of successful requests, from sending to reply.
+
+- queue_full, queue_failures - sends dropped because the remote's outgoing queue was full, or that
+  could not be queued at all (e.g. because the remote is not connected).
+
+- log_dropped - the number of log messages dropped (see `python_logging`).
+
+- coalescing - request coalescing counters (see the `coalesce` and `cache_ttl` send options):
+  `misses` (requests actually sent), `joined` (requests that shared an in-flight request's reply),
+  `hits` (requests answered from the reply cache), and `entries` (in-flight plus cached requests).
+
+- compression - payload compression counters (see `Compression`): messages (including replies)
+  sent `compressed`, with their total `compressed_raw_bytes` and `compressed_bytes` sizes and the
+  resulting `bytes_saved`; messages sent `uncompressed` (below the threshold, or incompressible) in
+  a compression envelope; compressed messages received (`decompressed`) with their total
+  `decompressed_bytes` and `decompressed_raw_bytes` sizes; `failures`, received compressed messages
+  that were rejected because they could not be decompressed or were sent to a command not accepting
+  compression; and `rejected`, sent compressed requests that the receiver rejected.
+
+Each latency histogram is a dict of `count`, `mean`, `max`, and `p50`, `p90`, `p99`, `p999`
+percentiles, in seconds.  Percentiles are approximate (to within about 12%).)")
+        .def("start", &OxenMQ::start, py::call_guard<py::gil_scoped_release>(), R"(Starts the OxenMQ object.
 
 This is called after all initialization (categories, etc.) is configured.  This binds to the bind
 locations given in the constructor and launches the proxy thread to handle message dispatching
@@ -436,19 +4311,24 @@ Things you want to do before calling this:
   remote SN connections will be erroneously treated as non-SN connections.
 - If this LMQ instance should accept incoming connections, set up any listening ports via
   `listen_curve()` and/or `listen_plain()`.)")
-        .def("listen", [](OxenMQ& self,
+        .def("listen", [](PyOxenMQ& self,
                     std::string bind,
                     bool curve,
-                    std::optional<py::function> pyallow,
+                    std::optional<std::variant<std::shared_ptr<connection_authorizer>, py::function>> pyallow,
                     std::function<void(bool success)> on_bind) {
             OxenMQ::AllowFunc allow;
-            if (pyallow)
+            if (pyallow && std::holds_alternative<std::shared_ptr<connection_authorizer>>(*pyallow))
+                allow = [auth = std::get<std::shared_ptr<connection_authorizer>>(*pyallow)](
+                        std::string_view addr, std::string_view pubkey, bool sn) {
+                    return (*auth)(addr, pubkey, sn);
+                };
+            else if (pyallow)
                 // We need to wrap this to pass the pubkey as bytes (otherwise pybind tries to utf-8
                 // encode it).
-                allow = [pyallow=std::move(*pyallow)](std::string_view addr, std::string_view pubkey, bool sn) {
+                allow = [pyallow=make_shared_pyobject(std::get<py::function>(std::move(*pyallow)))](std::string_view addr, std::string_view pubkey, bool sn) {
                     py::gil_scoped_acquire gil;
                     return py::cast<AuthLevel>(
-                        pyallow(addr, py::bytes{pubkey.data(), pubkey.size()}, sn)
+                        (*pyallow)(addr, py::bytes{pubkey.data(), pubkey.size()}, sn)
                     );
                 };
 
@@ -484,13 +4364,72 @@ Parameters:
   The function must return a AuthLevel value to accept the connection, or AuthLevel.denied to refuse
   it.  If omitted (or null) the default returns AuthLevel.none access for all incoming connections.
 
+  The function is called (with the gil) directly from the proxy thread, which stalls all message
+  routing while it runs.  Instead of a function this can be a ConnectionAuthorizer (from
+  `add_connection_authorizer()`), which caches decisions, supports static allow/deny pubkeys, and
+  can run the function in the background.
+
 - on_bind a callback to invoke when the port has been successfully opened or failed to open, called
   with a single boolean argument of True for success, False for failure.  For addresses set up
   before .start() this will be called during `start()` itself; for post-start listens this will be
   called from the proxy thread when it opens the new port.  Note that this function is called
   directly from the proxy thread and so should be fast and non-blocking.
 )")
-        .def("add_tagged_thread", [](OxenMQ& self, std::string name, std::function<void()> start) {
+        .def("add_connection_authorizer", [](PyOxenMQ& self,
+                    std::optional<py::function> callback,
+                    std::chrono::milliseconds cache_ttl,
+                    size_t max_entries,
+                    std::optional<py::dict> allow,
+                    std::optional<py::iterable> deny,
+                    bool background,
+                    AuthLevel pending_level,
+                    std::string name) {
+            std::optional<TaggedThreadID> thread;
+            if (background) {
+                if (!callback)
+                    throw std::logic_error{"background=True requires an authorizer callback"};
+                thread = self.add_tagged_thread(std::move(name));
+            }
+            auto auth = std::make_shared<connection_authorizer>(self,
+                    callback ? make_shared_pyobject(std::move(*callback)) : nullptr,
+                    cache_ttl, max_entries, std::move(thread), pending_level);
+            if (allow)
+                for (auto [pk, level] : *allow)
+                    auth->allow(checked_pubkey(pk), level.cast<AuthLevel>());
+            if (deny)
+                for (auto pk : *deny)
+                    auth->deny(checked_pubkey(pk));
+            return auth;
+        },
+        "callback"_a = std::nullopt, kwonly, "cache_ttl"_a = 5min, "max_entries"_a = 100000,
+        "allow"_a = std::nullopt, "deny"_a = std::nullopt, "background"_a = false,
+        "pending_level"_a = AuthLevel::denied, "name"_a = "auth",
+        py::keep_alive<0, 1>(),
+        R"(Creates a ConnectionAuthorizer to pass as `listen()`'s `allow_connection`.
+
+Decisions for incoming connections are made, in order, from:
+
+- the static `deny` pubkeys (an iterable of 32-byte pubkeys), which are always refused;
+- the static `allow` pubkeys (a dict of 32-byte pubkey to AuthLevel);
+- a cache of earlier `callback` decisions, keyed by the remote pubkey, address, and service node
+  status, which expire after `cache_ttl` (a timedelta; default 5 minutes; zero disables caching).
+  At most `max_entries` decisions are cached;
+- calling `callback` (with the same arguments as a plain `allow_connection` function) and caching
+  its result.  An exception raised by the callback refuses the connection (and is logged).  If there
+  is no callback then connections get AuthLevel.none.
+
+Only the cache lookup involves the proxy thread and no lookup acquires the gil, so (for example) a
+burst of reconnections from known remotes is authorized without touching python at all.
+
+If `background` is True then a cache miss never blocks the proxy on python: the connection is
+immediately given `pending_level` (by default AuthLevel.denied, refusing it) while `callback` is
+invoked on a dedicated tagged thread (named `name`) to fill the cache, so that the remote's next
+connection attempt (e.g. its automatic reconnection) receives the real decision.  This creates a
+tagged thread and so must be called *before* `start()`.
+
+Cached decisions only affect new connections; use the returned object's `invalidate()` (for
+example when a pubkey's access changes) to drop cached decisions.)")
+        .def("add_tagged_thread", [](PyOxenMQ& self, std::string name, std::function<void()> start) {
             return self.add_tagged_thread(std::move(name), std::move(start));
         },
         "name"_a, kwonly, "start"_a = std::nullopt,
@@ -552,6 +4491,48 @@ Batch jobs will first attempt to use an available general thread; an extra threa
 handle a batch job only if all general threads are currently busy *and* fewer than this many threads
 are currently processing batch jobs.)")
 
+        .def("batch_map", [](PyOxenMQ& self,
+                    py::function func,
+                    py::iterable iterable,
+                    std::optional<py::function> completion,
+                    std::optional<TaggedThreadID> thread) -> py::object {
+            if (completion) {
+                batch_map(self, std::move(func), py::list{iterable},
+                        [completion=std::move(*completion)](py::list results) { completion(std::move(results)); },
+                        std::move(thread));
+                return py::none();
+            }
+            auto result = std::make_shared<std::promise<py::list>>();
+            auto fut = result->get_future();
+            batch_map(self, std::move(func), py::list{iterable},
+                    [result](py::list results) { result->set_value(std::move(results)); },
+                    std::move(thread));
+            return py::cast(std::move(fut));
+        },
+        "func"_a, "iterable"_a, kwonly, "completion"_a = std::nullopt, "thread"_a = std::nullopt,
+        R"(Maps a function over an iterable as an OxenMQ batch job.
+
+Each element of `iterable` becomes a separate batch job that calls `func(element)`, distributed
+across OxenMQ's general and batch worker threads (see `set_batched_threads()`).  The gil is only held
+while calling `func`, so functions that release the gil while working (C++-implemented functions,
+hashing/signing of large values, etc.) run truly in parallel, using the same thread pool as message
+dispatch rather than a separate executor.
+
+Parameters:
+
+- func - the function to call for each element.
+
+- iterable - the elements to map over.  This is consumed immediately.
+
+- completion - if given, called with the list of results (in the same order as `iterable`) once
+  all jobs have completed.  For elements for which `func` raised an exception the result list
+  contains the exception instance instead of a value.
+
+- thread - a TaggedThreadID on which to invoke `completion`.  If omitted the completion is invoked
+  in the general batch job queue.
+
+Returns None if `completion` is given, otherwise a ResultFuture that resolves to the list of results
+described above.)")
         .def("add_timer", py::overload_cast<
                 std::function<void()>,
                 std::chrono::milliseconds,
@@ -582,8 +4563,73 @@ It is permitted to call this with the same TimerID multiple times; subsequent ca
 
 This submits a callback to be invoked by OxenMQ.  The job can either be scheduled with general batch
 jobs or can be directed to a specific tagged thread (created with `add_tagged_thread`).)")
-        .def("add_category", &OxenMQ::add_category,
+        .def("add_batch_dispatcher", [](PyOxenMQ& self,
+                    size_t max_batch,
+                    std::chrono::microseconds max_latency,
+                    std::string name) {
+            auto thread = self.add_tagged_thread(std::move(name));
+            return std::make_shared<batch_dispatcher>(self, std::move(thread), max_batch, max_latency);
+        },
+        kwonly, "max_batch"_a = 64, "max_latency"_a = 2ms, "name"_a = "batch-dispatch",
+        py::keep_alive<0, 1>(),
+        R"(Creates a batched command dispatcher.
+
+Commands and request commands registered with `dispatcher=` set to the returned object do not invoke
+their python callback directly from the oxenmq worker thread that receives them (which requires
+taking the gil for every message).  Instead the message is copied into a queue and the worker thread
+is immediately freed; a dedicated tagged thread then drains the queue, invoking the callbacks for up
+to `max_batch` queued messages under a single gil acquisition.  Under load this greatly reduces gil
+contention between worker threads, at the cost of serializing all python handling for the
+dispatcher onto one thread.
+
+A batch is dispatched as soon as `max_batch` messages are queued, or once the oldest queued message
+has waited `max_latency` (a timedelta; default 2ms), whichever comes first.  A single dispatcher
+may be shared by any number of commands and categories.
+
+This creates a tagged thread (named `name`) and so must be called *before* `start()`.)")
+        .def("add_priority_scheduler", [](PyOxenMQ& self,
+                    unsigned int threads,
+                    std::chrono::microseconds aging,
+                    size_t max_queue,
+                    std::string name) {
+            std::vector<TaggedThreadID> tids;
+            for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+                tids.push_back(self.add_tagged_thread(name + "-" + std::to_string(i)));
+            return std::make_shared<priority_scheduler>(self, std::move(tids), aging, max_queue);
+        },
+        kwonly, "threads"_a = 2, "aging"_a = 100ms, "max_queue"_a = 0, "name"_a = "priority",
+        py::keep_alive<0, 1>(),
+        R"(Creates a priority scheduler for command dispatch.
+
+oxenmq processes incoming commands in FIFO order (per category), so under overload cheap,
+latency-sensitive commands wait behind expensive ones.  Commands in categories added with
+`scheduler=` set to the returned object instead have their message copied into a per-priority queue
+(without touching the gil), and the scheduler's `threads` dedicated tagged threads dispatch queued
+commands highest priority first.
+
+To prevent starvation, a queued command's effective priority increases by one for every `aging`
+interval (a timedelta; default 100ms) it has been waiting: for example, with the default, a priority
+0 command that has waited 1 second is dispatched ahead of newly arrived priority 9 commands.  A zero
+`aging` disables this.
+
+Each scheduler thread keeps dispatching queued commands until the queues are empty.  If
+`max_queue` is non-zero, commands that arrive while `max_queue` commands are already queued are
+dropped (a dropped request gets no reply, so its requester times out) and counted in `dropped`;
+with the default of 0 the queues are unbounded.
+
+The scheduler's `stats()` reports the number of dispatched, queued and dropped commands, and a
+queue wait time histogram, for each priority.
+
+This creates tagged threads (named `name`-0, `name`-1, ...) and so must be called *before*
+`start()`.)")
+        .def("add_category", [](PyOxenMQ& self, std::string name, Access access_level,
+                    unsigned int reserved_threads, int max_queue,
+                    std::shared_ptr<priority_scheduler> scheduler, int priority) {
+            auto cat = self.add_category(name, std::move(access_level), reserved_threads, max_queue);
+            return category_helper{std::move(cat), self, std::move(name), std::move(scheduler), priority};
+        },
                 "name"_a, "access_level"_a, kwonly, "reserved_threads"_a = 0, "max_queue"_a = 200,
+                "scheduler"_a = nullptr, "priority"_a = 0,
                 py::keep_alive<0, 1>(),
                 R"(Add a new command category.
 
@@ -607,6 +4653,12 @@ max_queue - the maximum number of incoming commands that will be queued for comm
 category waiting for an available thread to process them before we start dropping new incoming
 commands.  -1 means unlimited, 0 means we never queue (i.e. we drop if no thread is immediately
 available).
+
+scheduler - a PriorityScheduler (from `add_priority_scheduler()`) through which all of this
+category's python commands are dispatched, in priority order.
+
+priority - the default priority of the category's commands, when using a scheduler.  Higher values
+are dispatched first.  Individual commands can override this with their own `priority`.
 )")
         .def("add_command_alias", &OxenMQ::add_command_alias,
                 "from"_a, "to"_a,
@@ -617,7 +4669,7 @@ This allows adding backwards-compatible aliases for commands that have moved.  F
 they had requested the dog.bark endpoint.  Note that this mapping happens *before* applying category
 permissions: in this example, the required permissions the access the endpoint would be those of the
 "dog" category rather than the "cat" category.)")
-        .def("connect_remote", [](OxenMQ& self,
+        .def("connect_remote", [](PyOxenMQ& self,
                     const address& remote,
                     OxenMQ::ConnectSuccess on_success,
                     OxenMQ::ConnectFailure on_failure,
@@ -645,7 +4697,7 @@ the connection fails).  The given callbacks are invoked for success or failure.
 and 10s, respectively).  `auth_level` can be specified to set the auth level of *incoming* requests
 that arrive through this connection.
 )")
-        .def("connect_remote", [](OxenMQ& self,
+        .def("connect_remote", [](PyOxenMQ& self,
                     const address& remote,
                     std::chrono::milliseconds timeout,
                     std::optional<bool> ephemeral_routing_id,
@@ -662,7 +4714,12 @@ that arrive through this connection.
                     connect_option::ephemeral_routing_id{ephemeral_routing_id.value_or(self.EPHEMERAL_ROUTING_ID)},
                     auth_level
                     );
-            return promise.get_future().get();
+            auto fut = promise.get_future();
+            {
+                py::gil_scoped_release no_gil;
+                fut.wait();
+            }
+            return fut.get();
         },
         "remote"_a,
         "timeout"_a = oxenmq::REMOTE_CONNECT_TIMEOUT,
@@ -672,10 +4729,66 @@ that arrive through this connection.
         R"(Simpler version of connect_remote that connects to a remote address synchronously.
 
 This will block until the connection is established or times out; throws on connection failure,
-returns the ConnectionID on success.
+returns the ConnectionID on success.  The gil is released while waiting.
 
 Takes the address and an optional `timeout` to override the timeout (default 10s))")
-        .def("connect_sn", [](OxenMQ& self,
+        .def("set_active_sns", [](PyOxenMQ& self, py::iterable pubkeys) {
+            auto pks = sn_pubkey_set(std::move(pubkeys));
+            py::gil_scoped_release no_gil;
+            self.set_active_sns(std::move(pks));
+        },
+        "pubkeys"_a,
+        R"(Replaces the set of active service node pubkeys.
+
+`pubkeys` is an iterable of 32-byte pubkeys.  Connections from these pubkeys are recognized as
+service nodes (for `remote_sn` category access, and `Message.conn.service_node`).  The whole set is
+applied at once by the proxy thread; existing connections to nodes no longer in the set have their
+service node status removed.)")
+        .def("update_active_sns", [](PyOxenMQ& self, py::iterable added, py::iterable removed) {
+            auto add = sn_pubkey_set(std::move(added)), remove = sn_pubkey_set(std::move(removed));
+            py::gil_scoped_release no_gil;
+            self.update_active_sns(std::move(add), std::move(remove));
+        },
+        "added"_a, "removed"_a,
+        R"(Incrementally updates the set of active service node pubkeys.
+
+Adds the pubkeys in `added` and removes those in `removed` (both iterables of 32-byte pubkeys) in a
+single update.  This is much cheaper than `set_active_sns()` for small changes to a large set.)")
+        .def("set_sn_addresses", [](PyOxenMQ& self, py::dict addresses) {
+            auto table = sn_address_map(std::move(addresses));
+            py::gil_scoped_release no_gil;
+            self.sn_addresses->replace(std::move(table));
+        },
+        "addresses"_a,
+        R"(Replaces the service node address table.
+
+`addresses` is a dict of 32-byte pubkey to connection string (such as "tcp://1.2.3.4:5678").  When
+connecting to a service node by pubkey the address is taken from this table natively, without
+calling into python, and the `sn_lookup` constructor callback (if any) is only invoked for pubkeys
+not in the table.  The new table replaces the old one atomically: concurrent lookups see either the
+old table or the new one, never a partial update.)")
+        .def("update_sn_addresses", [](PyOxenMQ& self, py::dict added, py::iterable removed) {
+            auto add = sn_address_map(std::move(added));
+            std::vector<std::string> remove;
+            for (auto pk : removed)
+                remove.push_back(checked_pubkey(pk));
+            py::gil_scoped_release no_gil;
+            self.sn_addresses->update(std::move(add), remove);
+        },
+        "added"_a = py::dict(), "removed"_a = py::tuple(),
+        R"(Atomically adds or replaces the addresses in `added` (a dict of 32-byte pubkey to
+connection string) and removes the pubkeys in `removed` from the service node address table.)")
+        .def("sn_address", [](PyOxenMQ& self, py::bytes pubkey) -> std::optional<std::string> {
+            auto addr = self.sn_addresses->find(checked_pubkey(pubkey));
+            if (addr.empty())
+                return std::nullopt;
+            return addr;
+        },
+        "pubkey"_a,
+        "Returns the address of `pubkey` in the service node address table, or None if not present.")
+        .def_property_readonly("sn_address_count", [](PyOxenMQ& self) { return self.sn_addresses->size(); },
+                "The number of service nodes in the address table")
+        .def("connect_sn", [](PyOxenMQ& self,
                     py::bytes pubkey,
                     std::optional<std::chrono::milliseconds> keep_alive,
                     std::optional<std::string> remote_hint,
@@ -734,7 +4847,7 @@ the OxenMQ object.  The connection works whether or not there are any accessible
 Also note that incoming inproc requests are unauthenticated: that is, they will always have
 admin-level access.
 )")
-        .def("disconnect", &OxenMQ::disconnect,
+        .def("disconnect", &OxenMQ::disconnect, py::call_guard<py::gil_scoped_release>(),
                 "conn"_a, "linger"_a = 1s,
                 R"(Disconnect an established connection.
 
@@ -746,89 +4859,10 @@ are still pending messages to be delivered; if those messages are not delivered
 time then the connection is closed anyway.  (Note that this is non-blocking: the lingering occurs in
 the background).)")
 
-        .def("send", [](OxenMQ& self, std::variant<ConnectionID, py::bytes> conn,
-                    std::string command,
+        .def("send", [](PyOxenMQ& self, std::variant<ConnectionID, py::bytes> to,
+                    std::string_view command,
                     py::args args, py::kwargs kwargs) {
-
-            if (auto* bytes = std::get_if<py::bytes>(&conn)) {
-                if (len(*bytes) != 32)
-                    throw std::logic_error{"Error: send(...) to=pubkey requires 32-byte pubkey"};
-                conn.emplace<ConnectionID>(static_cast<std::string>(*bytes));
-            }
-
-            bool request = kwargs.contains("request") && kwargs["request"].cast<bool>();
-            std::unique_ptr<py::function> on_reply, on_reply_failure;
-            if (request) {
-                if (kwargs.contains("on_reply"))
-                    on_reply = std::make_unique<py::function>(kwargs["on_reply"].cast<py::function>());
-                if (kwargs.contains("on_reply_failure"))
-                    on_reply_failure = std::make_unique<py::function>(kwargs["on_reply_failure"].cast<py::function>());
-            } else if (kwargs.contains("on_reply") || kwargs.contains("on_reply_failure")) {
-                throw std::logic_error{"Error: send(...) on_reply=/on_reply_failure= option "
-                    "requires request=True (perhaps you meant to use `.request(...)` instead?)"};
-            }
-            send_option::hint hint{kwargs.contains("remote_hint") ? kwargs["remote_hint"].cast<std::string>() : ""s};
-            send_option::optional optional{kwargs.contains("optional") && kwargs["optional"].cast<bool>()};
-            send_option::incoming incoming{kwargs.contains("incoming_only") && kwargs["incoming_only"].cast<bool>()};
-            send_option::outgoing outgoing{kwargs.contains("outgoing") && kwargs["outgoing"].cast<bool>()};
-            send_option::keep_alive keep_alive{
-                kwargs.contains("keep_alive") ? kwargs["keep_alive"].cast<std::chrono::milliseconds>() : -1ms};
-            send_option::request_timeout request_timeout{
-                kwargs.contains("request_timeout") ? kwargs["request_timeout"].cast<std::chrono::milliseconds>() : -1ms};
-            send_option::queue_failure qfail;
-            if (kwargs.contains("queue_failure"))
-                qfail.callback = [f = kwargs["queue_failure"].cast<std::function<void(std::string error)>>()]
-                    (const zmq::error_t* exc) {
-                        if (exc)
-                            f(exc->what());
-                    };
-            send_option::queue_full qfull;
-            if (kwargs.contains("queue_full"))
-                qfull.callback = kwargs["queue_full"].cast<std::function<void()>>();
-
-            std::vector<std::string> data;
-            for (auto arg: args)
-                extract_data_parts(data, arg);
-
-            if (!request) {
-                self.send(std::get<ConnectionID>(conn), command, send_option::data_parts(data),
-                        hint, optional, incoming, outgoing, keep_alive, request_timeout,
-                        std::move(qfail), std::move(qfull));
-            } else {
-                auto reply_cb = [reply_rawptr = on_reply.release(), fail_rawptr = on_reply_failure.release()]
-                    (bool success, std::vector<std::string> data) {
-                        // The gil here makes things tricky: the function invocation itself is
-                        // already gil protected, but the *destruction* of the lambda isn't, and
-                        // that breaks things because the destruction frees a python reference to
-                        // the callback.  However oxenmq invokes this callback exactly once so we
-                        // can deal with it by leaking raw pointers into the lambda captures then
-                        // reclaiming them the one and only time we are called.
-                        py::gil_scoped_acquire gil;
-                        std::unique_ptr<py::function> reply{reply_rawptr};
-                        std::unique_ptr<py::function> fail{fail_rawptr};
-
-                        if (success) {
-                            if (reply) {
-                                py::list l;
-                                for (const auto& part : data)
-                                    l.append(py::memoryview::from_memory(part.data(), part.size()));
-                                (*reply)(l);
-                            }
-                        } else {
-                            if (fail) {
-                                py::list l;
-                                for (const auto& part : data)
-                                    l.append(py::bytes(part.data(), part.size()));
-                                (*fail)(l);
-                            }
-                        }
-                    };
-
-                self.request(std::get<ConnectionID>(conn), command, std::move(reply_cb),
-                        send_option::data_parts(data),
-                        hint, optional, incoming, outgoing, keep_alive, request_timeout,
-                        std::move(qfail), std::move(qfull));
-            }
+            send_options{self, kwargs}.send(self, connection_id(std::move(to)), command, data_parts_view{args});
         },
         "conn"_a, "command"_a,
         R"(Sends a message or request to a remote.
@@ -845,9 +4879,12 @@ Parameters:
   on the remote, but note that to properly speak to request endpoints you will also need to specify
   `request=True` (or use the `.request()` wrapper method).
 
-- args - any additional non-keyword arguments must be str, bytes, or iterables of strings or bytes.
-  These will be flattened and sent as the data part of the message.  str values are decoded to utf8;
-  bytes values are sent as-is.
+- args - any additional non-keyword arguments must be str, bytes, other objects supporting the
+  contiguous buffer protocol (bytearray, memoryview, mmap, numpy arrays, etc.), or iterables of
+  these.  These will be flattened and sent as the data part of the message.  str values are encoded
+  to utf8; bytes and other buffer values are sent as-is.  The values are *not* copied before being
+  handed off to the proxy thread (and the gil is released while that happens), so there is no
+  advantage to converting large buffers to bytes first.
 
 The following keyword arguments may be provided:
 
@@ -856,10 +4893,24 @@ The following keyword arguments may be provided:
   wraps `send()` to specify this for you.
 
 - on_reply - function to call when a response to the request is received, when making a request with
-  request=True.  The function will be invoked with a single argument of a list of memoryviews into
-  the data returned by the remote side.  Note that these views are only valid for the duration of
-  the callback: if the data needs to be preserved beyond the callback then the callback must copy
-  it.  If this value is omitted or None then any successful response is simply discarded.
+  request=True.  The function will be invoked with a single argument of a list of `Buffer` objects
+  holding the data returned by the remote side.  These take ownership of the received data (without
+  copying it) and so, unlike `Message.dataview()`, remain valid for as long as they are referenced.
+  If this value is omitted or None then any successful response is simply discarded.
+
+- completion_queue - a CompletionQueue into which the result of the request (with request=True)
+  should be delivered instead of invoking on_reply/on_reply_failure (which may not be given).
+
+- tag - an arbitrary object delivered with the result when using completion_queue.
+
+- compression - a `Compression` with which to compress the message data (if it reaches the
+  compression threshold).  The remote command must have been added with `compression=` to be able
+  to receive it; see `Compression` for what happens when it wasn't.  For a request this also allows the remote to compress its reply, which is
+  decompressed before being passed to on_reply (or to the future, queue, etc.).  Compression and
+  decompression are done without holding the gil.
+
+- reply_bytes - if true then on_reply is invoked with a list of `bytes` copies of the reply parts
+  rather than `Buffer`s, for code that requires actual `bytes` objects.
 
 - on_reply_failure - function to call if we do not get a successful reply, either for a timeout or
   because the remote sent us a failure reply.  Called with a list of bytes containing failure
@@ -880,6 +4931,15 @@ The following keyword arguments may be provided:
   reply callback with a failure status.  The default, if unspecified, is 15 seconds.  Should only be
   specified when request=True.
 
+- coalesce - if true (and request=True) then identical coalescing requests (i.e. to the same
+  connection, with the same command and data parts) made while this one is in flight are not sent
+  but instead share this request's reply (or failure).  Intended for read-only requests where
+  many callers frequently ask the same thing at the same time.
+
+- cache_ttl - a timedelta for which a successful reply to a coalescing request is cached and
+  returned for identical coalescing requests without sending anything.  Implies coalesce=True.
+  Cached replies are delivered from an OxenMQ worker thread, just as real replies are.
+
 - queue_failure - a callback to invoke with an error message if we are unable to queue the message
   for some reason (e.g. because the recipient is no longer reachable available).  This does *not*
   include an inability because we have too much queued already: see the next option for that.  Note
@@ -910,6 +4970,106 @@ function during construction) the following options are also available:
   increased if currently shorter, and for new connections this sets the keep-alive.  Has no effect
   if the messages uses an existing incoming connection.
 )")
+        .def("set_compression_supported", [](PyOxenMQ& self, std::variant<ConnectionID, py::bytes> conn,
+                    std::string command, bool supported) {
+            self.compression_fallback->set(connection_id(std::move(conn)), std::move(command), supported);
+        },
+        "conn"_a, "command"_a, "supported"_a = true,
+        R"(Records whether a remote command accepts compressed messages.
+
+Normally this is learned from the replies to requests sent with `compression=`: compressed plain
+messages (from `send(..., compression=...)`) are only actually compressed once a compressed request
+to the same command on the same connection has succeeded, since a plain message to a command that
+can't take compression would be silently dropped.  Use this when it is known by other means (for
+instance, for a command that isn't a request command) that the command on `conn` (a ConnectionID
+or pubkey) was added with `compression=`, or to stop compressing messages to it.)")
+        .def("stream_send", [](PyOxenMQ& self, std::variant<ConnectionID, py::bytes> conn, std::string_view command,
+                    py::object source, size_t chunk_size, size_t window, std::chrono::milliseconds timeout) {
+            return stream_send(self, connection_id(std::move(conn)), command, source, chunk_size, window, timeout);
+        },
+        "conn"_a, "command"_a, "source"_a, kwonly,
+        "chunk_size"_a = 256*1024, "window"_a = 8, "timeout"_a = 15s,
+        R"(Sends a stream of data to a stream command on a remote.
+
+Sends `source` to `command`, which must have been registered on the remote with
+`Category.add_stream_command()`, as a sequence of chunks of at most `chunk_size` bytes.  `source`
+may be an object with a `read(size)` method (such as a file opened in binary mode), a bytes-like
+object, or an iterable of bytes-like objects (such as a generator).
+
+At most `window` chunks are sent ahead of the receiver's consumption of them, so this blocks
+(with the gil released) whenever the receiver falls behind.  Only the current chunk of `source`
+needs to be in memory at once, and memory use on both ends is bounded by about
+`chunk_size * window` regardless of the total size.
+
+Parameters:
+
+- conn -- the ConnectionID or pubkey to send to
+- command -- the remote stream command, e.g. "snapshot.upload"
+- source -- the data to send, as described above
+- chunk_size -- the maximum chunk size (default 256kiB)
+- window -- the maximum number of unacknowledged chunks in flight (default 8); this may not exceed
+  the receiving command's `max_window`
+- timeout -- how long to wait for each chunk's acknowledgement (default 15s)
+
+Returns the number of bytes sent once the receiver has consumed the entire stream.  Raises
+TimeoutError if a chunk is not acknowledged in time, and RuntimeError if the stream fails (for
+instance because the receiver closed it).  If reading `source` raises then the stream is aborted on
+the receiver and the exception is propagated.)")
+        .def("publish", [](PyOxenMQ& self, const std::string& topic, py::args args) {
+            data_parts_view data{args};
+            py::gil_scoped_release no_gil;
+            auto subs = self.pubsub->subscribers(topic);
+            for (auto& [conn, command] : subs)
+                self.send(conn, command, data.send_parts(), send_option::optional{});
+            self.stats->messages_sent.fetch_add(subs.size(), std::memory_order_relaxed);
+            return subs.size();
+        },
+        "topic"_a,
+        R"(Publishes a message to all current subscribers of a topic.
+
+Each subscriber receives the given data parts on the command it subscribed with.  The data parts
+are converted once and the whole fan-out happens with the gil released.
+
+Subscriptions are not removed when a subscriber disconnects: they remain (and keep being counted
+and published to) until they expire at the end of their ttl or are unsubscribed.  Messages are sent
+with `optional=True`, which only matters for subscribers identified by service node pubkey: no new
+connection is established to such a subscriber just to deliver a publication.
+
+Returns the number of subscribers the message was sent to.
+
+Subscriptions are added by remotes via the commands added with `Category.add_pubsub_commands()`,
+or locally with `subscribe()`.)")
+        .def("subscribe", [](PyOxenMQ& self, const std::string& topic,
+                    std::variant<ConnectionID, py::bytes> conn, std::string command, std::chrono::milliseconds ttl) {
+            return *self.pubsub->subscribe(topic, connection_id(std::move(conn)), std::move(command), ttl);
+        },
+        "topic"_a, "conn"_a, "command"_a, kwonly, "ttl"_a = 30min,
+        R"(Subscribes a connection to a topic.
+
+Publications to `topic` will be sent to `conn` (a ConnectionID or pubkey) as `command` messages
+until `ttl` expires or the subscription is removed.  Returns True if this is a new subscription,
+False if it renewed an existing one.)")
+        .def("unsubscribe", [](PyOxenMQ& self, const std::string& topic, std::variant<ConnectionID, py::bytes> conn) {
+            return self.pubsub->unsubscribe(topic, connection_id(std::move(conn)));
+        },
+        "topic"_a, "conn"_a,
+        "Removes a topic subscription; returns True if the subscription existed.")
+        .def("subscribers", [](PyOxenMQ& self, const std::string& topic) {
+            return self.pubsub->subscribers(topic).size();
+        },
+        "topic"_a,
+        "Returns the number of current (unexpired) subscribers of a topic.")
+        .def("prepare_send", [](PyOxenMQ& self, std::string command, py::kwargs kwargs) {
+            return send_template{self, std::move(command), send_options{self, kwargs}};
+        },
+        "command"_a, py::keep_alive<0, 1>(),
+        R"(Prepares a send template for repeatedly sending the same command with the same options.
+
+Takes a command and the same keyword options as `send()` (including `request=True` and the reply
+callbacks), resolving the options just once.  The returned SendTemplate is then called as
+`template(conn, *args)` to send to `conn` (a ConnectionID or pubkey) with data parts `args`; only
+the data parts are converted per call.  This is considerably faster than calling `send()` when the
+same command and options are used at a high rate.)")
         .def("request", [](py::handle self, py::args args, py::kwargs kwargs) {
             self.attr("send")(*args, **kwargs, "request"_a = true);
         },
@@ -930,68 +5090,37 @@ OxenMQ requests so that both are treated fairly in terms of processing priority.
         .value("deferred", std::future_status::deferred)
         .value("ready", std::future_status::ready)
         .value("timeout", std::future_status::timeout);
-    py::class_<std::future<py::list>>(mod, "ResultFuture",
-            "Wrapper around a C++ future allowing inspecting and waiting for the result to become available.")
-        .def("get", [](std::future<py::list>& f) {
-            {
-                py::gil_scoped_release no_gil;
-                f.wait();
-            }
-            return f.get();
-        }, "Gets the result (or raises an exception if the result raised an exception); must only be called once")
-        .def("valid", [](std::future<py::list>& f) { return f.valid(); },
-                "Returns true if the result is available")
-        .def("wait", &std::future<py::list>::wait, py::call_guard<py::gil_scoped_release>(),
-                "Waits indefinitely for the result to become available")
-        .def("wait_for", &std::future<py::list>::template wait_for<double, std::ratio<1>>,
-                py::call_guard<py::gil_scoped_release>(),
-                "Waits up to the given timedelta for the result to become available")
-        .def("wait_for", [](std::future<py::list>& f, double seconds) {
-            return f.wait_for(std::chrono::duration<double>{seconds}); },
-            py::call_guard<py::gil_scoped_release>(),
-            "Waits up to the given number of seconds for the result to become available")
-        .def("wait_until",
-                &std::future<py::list>::template wait_until<std::chrono::system_clock, std::chrono::system_clock::duration>,
-                py::call_guard<py::gil_scoped_release>(),
-                "Wait until the given datetime for the result to become available")
-        ;
-
-    oxenmq.def("request_future", [](py::handle self, py::args args, py::kwargs kwargs) {
+    bind_future<py::list>(mod, "ResultFuture",
+            "Wrapper around a C++ future allowing inspecting and waiting for the result to become available.");
+    bind_future<py::dict>(mod, "GatherFuture",
+            "Future returned by OxenMQ.request_many(); the result is a dict of per-target results.");
+
+    // request_future and request_async work with anything with a request(..., on_reply=,
+    // on_reply_failure=) method; they are bound on both OxenMQ and RemotePool.
+    auto request_future = [](py::handle self, py::args args, py::kwargs kwargs) {
         if (kwargs.contains("on_reply") || kwargs.contains("on_reply_failure"))
             throw std::logic_error{"Cannot call request_future(...) with on_reply= or on_reply_failure="};
 
         auto result = std::make_shared<std::promise<py::list>>();
         auto fut = result->get_future();
-        std::function on_reply = [result](py::list value) {
-            assert(len(value) == 0 || py::isinstance<py::memoryview>(value[0]));
-            for (int i = len(value) - 1; i >= 0; i--)
-                value[i] = value[i].attr("tobytes")();
-            result->set_value(std::move(value));
-        };
+        std::function on_reply = [result](py::list value) { result->set_value(std::move(value)); };
         std::function on_fail = [result](py::list value) {
-            if (len(value) > 0 && (std::string) py::bytes(value[0]) == "TIMEOUT"sv) {
-                auto msg = len(value) > 1 ? (std::string) py::bytes(value[1]) : "Request timed out"s;
-                PyErr_SetString(PyExc_TimeoutError, msg.c_str());
-                result->set_exception(std::make_exception_ptr(py::error_already_set{}));
-            }
-
-            std::string err;
-            for (auto& m : value) {
-                if (!err.empty()) err += ", ";
-                err += py::str(m);
-            }
-            result->set_exception(std::make_exception_ptr(std::runtime_error{"Request failed: " + err}));
+            auto exc = reply_failure_exception(value);
+            PyErr_SetObject(reinterpret_cast<PyObject*>(Py_TYPE(exc.ptr())), exc.ptr());
+            result->set_exception(std::make_exception_ptr(py::error_already_set{}));
         };
 
         self.attr("request")(*args, **kwargs,
                 "on_reply"_a = std::move(on_reply),
                 "on_reply_failure"_a = std::move(on_fail));
         return fut;
-    }, R"(Initiate a request with a future.
+    };
+    oxenmq.def("request_future", request_future, R"(Initiate a request with a future.
 
 Initiates a request and returns a future that is used to check and wait for a response to the
 request.  Takes the same arguments as .request(...), but without the `on_reply` and
-`on_reply_failure` options.
+`on_reply_failure` options.  The future's result is the list of `Buffer` reply parts, or of `bytes`
+if `reply_bytes=True` is given.
 
 This can be used to make a synchronous request by simply calling .get() on the returned future:
 
@@ -1004,6 +5133,187 @@ This can be used to make a synchronous request by simply calling .get() on the r
 
 More powerfully, you can issue multiple, parallel requests storing the returned futures then .get()
 all of them to collect the responses.)");
+
+    auto request_async = [](py::handle self, py::args args, py::kwargs kwargs) {
+        if (kwargs.contains("on_reply") || kwargs.contains("on_reply_failure"))
+            throw std::logic_error{"Cannot call request_async(...) with on_reply= or on_reply_failure="};
+
+        auto future = make_asyncio_future();
+        std::function on_reply = [future](py::list value) { resolve_asyncio_future(*future, std::move(value)); };
+        std::function on_fail = [future](py::list value) {
+            resolve_asyncio_future(*future, reply_failure_exception(value), true);
+        };
+
+        self.attr("request")(*args, **kwargs,
+                "on_reply"_a = std::move(on_reply),
+                "on_reply_failure"_a = std::move(on_fail));
+        return *future;
+    };
+    oxenmq.def("request_async", request_async, R"(Initiate a request returning an asyncio awaitable.
+
+This is the asyncio equivalent of `request_future`: it takes the same arguments as .request(...),
+without the `on_reply` and `on_reply_failure` options, and must be called from a coroutine running
+in an asyncio event loop.  The returned asyncio.Future resolves to the list of `Buffer` reply parts
+(or of `bytes`, if `reply_bytes=True` is given), or raises TimeoutError/RuntimeError on request
+failure.
+
+The reply is delivered to the event loop via `call_soon_threadsafe` from the OxenMQ thread that
+receives it, so no executor thread is tied up per outstanding request:
+
+    async def get_info(omq, conn):
+        try:
+            return await omq.request_async(conn, "rpc.get_info")
+        except TimeoutError:
+            print("Request timed out!")
+)");
+
+    oxenmq.def("connect_remote_async", [](PyOxenMQ& self,
+                const address& remote,
+                std::chrono::milliseconds timeout,
+                std::optional<bool> ephemeral_routing_id,
+                AuthLevel auth_level) {
+            auto future = make_asyncio_future();
+            self.connect_remote(
+                    remote,
+                    [future](ConnectionID id) {
+                        py::gil_scoped_acquire gil;
+                        resolve_asyncio_future(*future, py::cast(std::move(id)));
+                    },
+                    [future](auto, std::string_view reason) {
+                        py::gil_scoped_acquire gil;
+                        resolve_asyncio_future(*future,
+                                py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(
+                                    "Connection failed: " + std::string{reason}),
+                                true);
+                    },
+                    connect_option::timeout{timeout},
+                    connect_option::ephemeral_routing_id{ephemeral_routing_id.value_or(self.EPHEMERAL_ROUTING_ID)},
+                    auth_level
+                    );
+            return *future;
+        },
+        "remote"_a,
+        "timeout"_a = oxenmq::REMOTE_CONNECT_TIMEOUT,
+        kwonly,
+        "ephemeral_routing_id"_a = std::nullopt,
+        "auth_level"_a = AuthLevel::none,
+        R"(asyncio version of connect_remote.
+
+Takes the same arguments as the synchronous `connect_remote(remote, timeout)` but, rather than
+blocking, returns an asyncio.Future (which must be awaited from a coroutine in a running event loop)
+that resolves to the ConnectionID once connected, or raises a RuntimeError if the connection fails.)");
+
+    oxenmq.def("request_many", [](PyOxenMQ& self, py::object targets, std::string_view command, py::args args,
+                std::optional<size_t> quorum, std::chrono::milliseconds timeout) {
+            auto result = std::make_shared<std::promise<py::dict>>();
+            auto fut = result->get_future();
+            request_many(self, py::tuple{targets}, command, std::move(args), quorum, timeout,
+                    [result](py::dict d) { result->set_value(std::move(d)); });
+            return fut;
+        },
+        "targets"_a, "command"_a, kwonly, "quorum"_a = std::nullopt, "timeout"_a = 15s,
+        R"(Sends the same request to multiple targets, gathering the replies into a single future.
+
+This is considerably more efficient than issuing individual requests: the data parts are converted
+just once, and all requests are queued in one call with the gil released.
+
+Parameters:
+
+- targets - an iterable of ConnectionIDs and/or 32-byte `bytes` service node pubkeys.  Raises
+  ValueError if a target is repeated.
+
+- command - the request endpoint to invoke on each target.
+
+- args - data parts to send, as for `send()`.
+
+- quorum - if given, the future completes as soon as this many targets have replied successfully (or
+  as soon as so many targets have failed that the quorum can no longer be reached).  If omitted, the
+  future completes once every target has replied or failed.
+
+- timeout - the request timeout applied to each request (default 15 seconds).
+
+Returns a GatherFuture whose result is a dict keyed by the given targets.  The value for each target
+is a list of `Buffer` reply parts for a successful reply; a TimeoutError or RuntimeError exception
+instance (not raised) for a failed request; or None if the future completed (because of the quorum)
+before that target replied.)");
+
+    oxenmq.def("request_many_async", [](PyOxenMQ& self, py::object targets, std::string_view command, py::args args,
+                std::optional<size_t> quorum, std::chrono::milliseconds timeout) {
+            auto future = make_asyncio_future();
+            request_many(self, py::tuple{targets}, command, std::move(args), quorum, timeout,
+                    [future](py::dict d) { resolve_asyncio_future(*future, std::move(d)); });
+            return *future;
+        },
+        "targets"_a, "command"_a, kwonly, "quorum"_a = std::nullopt, "timeout"_a = 15s,
+        R"(asyncio version of request_many.
+
+Takes the same arguments as `request_many()`, but returns an asyncio.Future (which must be awaited
+from a coroutine in a running event loop) resolving to the dict of per-target results.)");
+
+    py::class_<remote_pool, std::shared_ptr<remote_pool>>(mod, "RemotePool",
+            "Load-balanced pool of connections to equivalent remotes; returned by OxenMQ.remote_pool(...)")
+        .def("request", [](remote_pool& pool, std::string_view command, py::args args, py::kwargs kwargs) {
+            if (kwargs.contains("coalesce") || kwargs.contains("cache_ttl"))
+                throw std::logic_error{"RemotePool.request(...) does not support coalesce= or cache_ttl="};
+            kwargs["request"] = true;
+            send_options options{pool.omq(), kwargs};
+            pool.request(command, data_parts_view{args}, options);
+        },
+        "command"_a,
+        R"(Sends a request to the best currently available backend.
+
+Takes the same arguments as `OxenMQ.request()` except for the connection (and the coalesce/cache_ttl
+options, which are not supported).  Raises RuntimeError if no backend is currently connected and
+not ejected.)")
+        .def("request_future", request_future,
+                "As `OxenMQ.request_future()`, but sending to the best available backend of the pool.")
+        .def("request_async", request_async,
+                "As `OxenMQ.request_async()`, but sending to the best available backend of the pool.")
+        .def_property_readonly("backends", &remote_pool::status,
+                R"(The status of each of the pool's backends, as a list of dicts (in the order given
+when constructing the pool).  Each dict contains the backend's `address`, connection `state`
+("connecting", "connected", or "disconnected"), whether it is currently `ejected`, the number of
+`outstanding` requests, totals of `requests`, `failures`, and `ejections`, and its EWMA `latency` in
+seconds (None until measured).)")
+        ;
+
+    oxenmq.def("remote_pool", [](PyOxenMQ& self, std::vector<address> remotes, std::string_view strategy,
+                unsigned max_failures, std::chrono::milliseconds ejection_time, double ewma_alpha,
+                AuthLevel auth_level) {
+            remote_pool::strategy strat;
+            if (strategy == "least_outstanding")
+                strat = remote_pool::strategy::least_outstanding;
+            else if (strategy == "ewma")
+                strat = remote_pool::strategy::ewma;
+            else
+                throw std::invalid_argument{"Invalid RemotePool strategy '" + std::string{strategy} +
+                    "': expected 'least_outstanding' or 'ewma'"};
+            auto pool = std::make_shared<remote_pool>(self, std::move(remotes), strat, max_failures,
+                    ejection_time, ewma_alpha, auth_level);
+            pool->start();
+            return pool;
+        },
+        "remotes"_a, kwonly, "strategy"_a = "least_outstanding", "max_failures"_a = 5,
+        "ejection_time"_a = 30s, "ewma_alpha"_a = 0.3, "auth_level"_a = AuthLevel::none,
+        py::keep_alive<0, 1>(),
+        R"(Creates a pool of connections to several equivalent remotes and routes requests across them.
+
+The pool connects to every address in `remotes`; requests made through the pool's `request()`,
+`request_future()` and `request_async()` methods are then each sent to one connected backend,
+chosen natively (without involving python) by `strategy`:
+
+- "least_outstanding" (the default) - the backend with the fewest requests awaiting replies.
+- "ewma" - the backend with the lowest expected latency: its exponentially weighted moving average
+  reply latency (with weight `ewma_alpha` for each new sample) multiplied by its outstanding
+  requests plus one.
+
+Ties are broken round-robin.  A backend whose last `max_failures` requests all failed (timed out, or
+got a failure reply) is ejected: it receives no requests for `ejection_time`, and its connection is
+dropped and re-established.  The last available backend is never ejected.  Backends that fail to
+connect are retried after `reconnect_interval`, backing off exponentially up to
+`reconnect_interval_max`.
+
+Must be called after `start()`.  `auth_level` is as for `connect_remote()`.)");
 }
 
 } // namespace oxenmq
@@ -1,8 +1,9 @@
 
-from oxenmq import OxenMQ, Message, LogLevel, AuthLevel, Address
+from oxenmq import OxenMQ, Message, LogLevel, AuthLevel, Address, Access, bt_encode, bt_decode, BtDict, BtList
 import random
 import string
 from datetime import datetime, timedelta
+import threading
 import time
 import pytest
 
@@ -21,7 +22,8 @@ def zmq_address():
     sock = './' + ''.join(random.choices(string.ascii_letters, k=20)) + '.sock'
     addr = 'ipc://' + sock
     yield addr
-    os.remove(sock)
+    if os.path.exists(sock):
+        os.remove(sock)
 
 
 def make_omqs(zmq_addr, start=True):
@@ -124,3 +126,942 @@ def test_commands(zmq_address):
         time.sleep(0.01)
     assert val3 == ['CMD-later got', b'cool']
 
+
+
+def test_buffer_parts(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address)
+    c1 = omq2.connect_remote(addr)
+
+    data = bytearray(b'abc')
+    blob = bytes(range(256)) * 4096
+    reply = omq2.request_future(c1, 'cat.echo', data, memoryview(blob)[1:-1], [b'x', 'y']).get()
+    assert reply == [b'Hi!', b'abc', blob[1:-1], b'x', b'y']
+
+    with pytest.raises(RuntimeError):
+        omq2.request(c1, 'cat.echo', 42)
+
+
+def test_request_async(zmq_address):
+    import asyncio
+    omq1, omq2, addr = make_omqs(zmq_address)
+
+    async def run():
+        c1 = await omq2.connect_remote_async(addr)
+        replies = await asyncio.gather(
+                *(omq2.request_async(c1, 'cat.echo', str(i)) for i in range(100)))
+        assert replies == [[b'Hi!', str(i).encode()] for i in range(100)]
+
+        with pytest.raises(RuntimeError):
+            await omq2.request_async(c1, 'cat.nope')
+
+    asyncio.run(asyncio.wait_for(run(), 5))
+
+
+def test_batch_dispatcher(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+
+    disp = omq1.add_batch_dispatcher(max_batch=16)
+    received = []
+    omq1.add_category('b', AuthLevel.none) \
+        .add_command('cmd', lambda m: received.append(m.data()[0]), dispatcher=disp) \
+        .add_request_command('echo', echo, dispatcher=disp)
+
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+    for i in range(100):
+        omq2.send(c1, 'b.cmd', str(i))
+    assert omq2.request_future(c1, 'b.echo', 'abc').get() == [b'Hi!', b'abc']
+
+    # The counters are updated after the batch's handlers return, so wait for those too
+    timeout = datetime.now() + timedelta(seconds=1)
+    while (len(received) < 100 or disp.messages < 101) and datetime.now() < timeout:
+        time.sleep(0.01)
+
+    assert sorted(received) == sorted(str(i).encode() for i in range(100))
+    assert disp.messages == 101
+    assert 0 < disp.batches <= 101
+
+
+def test_priority_scheduler(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+
+    sched = omq1.add_priority_scheduler(threads=1, aging=timedelta(seconds=10))
+    assert sched.threads == 1
+    gate = threading.Event()
+    order = []
+
+    def slow(m):
+        gate.wait(5)
+        order.append(b'slow')
+
+    omq1.add_category('p', AuthLevel.none, scheduler=sched) \
+        .add_command('slow', slow, priority=100) \
+        .add_command('low', lambda m: order.append(m.data()[0])) \
+        .add_command('high', lambda m: order.append(m.data()[0]), priority=5)
+
+    with pytest.raises(RuntimeError):
+        omq1.add_category('q', AuthLevel.none).add_command('x', slow, priority=1)
+
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+    # The slow command blocks the only scheduler thread while the others queue up behind it
+    omq2.send(c1, 'p.slow')
+    timeout = datetime.now() + timedelta(seconds=1)
+    while sched.stats().get(100, {}).get('dispatched', 0) < 1 and datetime.now() < timeout:
+        time.sleep(0.01)
+    for i in range(3):
+        omq2.send(c1, 'p.low', 'low')
+        omq2.send(c1, 'p.high', 'high')
+    timeout = datetime.now() + timedelta(seconds=1)
+    while sched.queued < 6 and datetime.now() < timeout:
+        time.sleep(0.01)
+    gate.set()
+
+    timeout = datetime.now() + timedelta(seconds=2)
+    while len(order) < 7 and datetime.now() < timeout:
+        time.sleep(0.01)
+
+    assert order == [b'slow'] + [b'high'] * 3 + [b'low'] * 3
+    stats = sched.stats()
+    assert stats[0]['dispatched'] == 3 and stats[5]['dispatched'] == 3
+    assert stats[0]['queued'] == 0 and sched.queued == 0
+    assert stats[5]['wait']['count'] == 3
+
+
+def test_priority_scheduler_max_queue(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+
+    sched = omq1.add_priority_scheduler(threads=1, max_queue=2)
+    assert sched.max_queue == 2
+    gate = threading.Event()
+    done = []
+
+    def slow(m):
+        gate.wait(5)
+        done.append(b'slow')
+
+    omq1.add_category('p', AuthLevel.none, scheduler=sched) \
+        .add_command('slow', slow) \
+        .add_command('low', lambda m: done.append(m.data()[0]))
+
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+    omq2.send(c1, 'p.slow')
+    timeout = datetime.now() + timedelta(seconds=1)
+    while sched.stats().get(0, {}).get('dispatched', 0) < 1 and datetime.now() < timeout:
+        time.sleep(0.01)
+    for i in range(5):
+        omq2.send(c1, 'p.low', str(i))
+    timeout = datetime.now() + timedelta(seconds=1)
+    while sched.queued + sched.dropped < 5 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert sched.queued == 2 and sched.dropped == 3
+    gate.set()
+
+    timeout = datetime.now() + timedelta(seconds=2)
+    while len(done) < 3 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert done == [b'slow', b'0', b'1']
+    assert sched.stats()[0]['dropped'] == 3
+
+
+def test_request_many(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address)
+    c1 = omq2.connect_remote(addr)
+    c2 = omq2.connect_remote(addr)
+
+    results = omq2.request_many([c1, c2], 'cat.echo', 'abc').get()
+    assert results == {c1: [b'Hi!', b'abc'], c2: [b'Hi!', b'abc']}
+
+    results = omq2.request_many([c1, c2], 'cat.nope').get()
+    assert all(isinstance(r, RuntimeError) for r in results.values())
+
+    results = omq2.request_many([c1, c2], 'cat.echo', quorum=1).get()
+    assert [b'Hi!'] in results.values()
+
+    assert omq2.request_many([], 'cat.echo').get() == {}
+    with pytest.raises(ValueError):
+        omq2.request_many([c1, c2, c1], 'cat.echo', quorum=2)
+
+
+def test_batch_map():
+    import hashlib
+    omq = OxenMQ()
+    tagged = omq.add_tagged_thread('mapper')
+    omq.start()
+
+    data = [bytes([i]) * 1000 for i in range(20)]
+    results = omq.batch_map(lambda x: hashlib.sha256(x).digest(), data).get()
+    assert results == [hashlib.sha256(x).digest() for x in data]
+
+    def maybe_fail(x):
+        if x == 3:
+            raise ValueError("three")
+        return x * 2
+
+    done = []
+    omq.batch_map(maybe_fail, range(5), completion=done.append)
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not done and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert done[0][:3] == [0, 2, 4] and done[0][4] == 8
+    assert isinstance(done[0][3], ValueError)
+
+    assert omq.batch_map(str, []).get() == []
+
+    # Even an empty batch completes on the requested thread, not synchronously
+    tagged_ident = []
+    omq.job(lambda: tagged_ident.append(threading.get_ident()), thread=tagged)
+    done = []
+    omq.batch_map(str, [], completion=lambda r: done.append((r, threading.get_ident())), thread=tagged)
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not (done and tagged_ident) and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert done == [([], tagged_ident[0])]
+    assert tagged_ident[0] != threading.get_ident()
+
+
+def test_native_commands(zmq_address):
+    from oxenmq import native_count_parts
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+
+    omq1.add_category('n', AuthLevel.none) \
+        .add_static_request_command('ping', 'pong', b'!') \
+        .add_echo_request_command('echo', 'echo:') \
+        .add_native_request_command('count', native_count_parts) \
+        .add_native_command('count_plain', native_count_parts)
+
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+    assert omq2.request_future(c1, 'n.ping', 'ignored').get() == [b'pong', b'!']
+    assert omq2.request_future(c1, 'n.echo', 'a', b'b').get() == [b'echo:', b'a', b'b']
+    assert omq2.request_future(c1, 'n.count', 'a', 'b', 'c').get() == [b'3']
+    omq2.send(c1, 'n.count_plain', 'a')
+    timeout = datetime.now() + timedelta(seconds=1)
+    while omq1.stats()['commands']['n.count_plain']['invocations'] < 1 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert omq1.stats()['commands']['n.count_plain']['invocations'] == 1
+
+
+def test_python_logging(caplog):
+    import logging
+    caplog.set_level(5, logger='oxenmq')
+    omq = OxenMQ(python_logging=True, log_level=LogLevel.debug, log_drain_interval=timedelta(milliseconds=10))
+    omq.start()
+
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not caplog.records and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert caplog.records
+    assert all(r.name == 'oxenmq' for r in caplog.records)
+    assert omq.log_dropped == 0
+
+
+def test_stats(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('slow', AuthLevel.none).add_request_command('never', lambda m: None)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    for i in range(10):
+        omq2.request_future(c1, 'cat.echo', str(i)).get()
+    with pytest.raises(TimeoutError):
+        omq2.request_future(c1, 'slow.never', request_timeout=timedelta(milliseconds=10)).get()
+
+    # The handler time is recorded when the handler returns, which can be after its reply arrives
+    timeout = datetime.now() + timedelta(seconds=1)
+    while True:
+        s1, s2 = omq1.stats(), omq2.stats()
+        echo = s1['commands']['cat.echo']
+        if echo['handler_time']['count'] == echo['invocations'] or datetime.now() >= timeout:
+            break
+        time.sleep(0.01)
+    assert echo['invocations'] >= 10
+    assert echo['errors'] == 0
+    assert echo['handler_time']['count'] == echo['invocations']
+    assert s1['commands']['cat.ohce']['invocations'] == 0
+    assert s1['categories']['cat']['invocations'] == echo['invocations']
+
+    assert s2['requests_sent'] == 11
+    assert s2['replies'] == 10
+    assert s2['reply_timeouts'] == 1
+    assert s2['request_latency']['count'] == 10
+    assert 0 < s2['request_latency']['p50'] <= s2['request_latency']['max']
+
+
+def test_connect_releases_gil(zmq_address):
+    import threading
+
+    # allow_connection is invoked from the server's proxy thread and needs the gil, which would
+    # deadlock if the synchronous connect_remote below held it while waiting.
+    allowed = []
+    server = OxenMQ()
+    addr = Address(zmq_address, server.pubkey)
+
+    def allow(ip, pubkey, sn):
+        allowed.append(pubkey)
+        return AuthLevel.none
+
+    server.listen(addr.zmq_address, curve=True, allow_connection=allow)
+    busy = threading.Event()
+
+    def slow(m):
+        busy.set()
+        # Pure-python busy work that holds the gil
+        end = time.perf_counter() + 0.05
+        while time.perf_counter() < end:
+            pass
+        return 'done'
+
+    server.add_category('cat', AuthLevel.none).add_request_command('slow', slow)
+    server.start()
+
+    clients = [OxenMQ() for _ in range(8)]
+    for c in clients:
+        c.start()
+    c0 = clients[0].connect_remote(addr)
+    futures = [clients[0].request_future(c0, 'cat.slow') for _ in range(8)]
+    assert busy.wait(1)
+
+    errors = []
+
+    def connect(omq):
+        try:
+            conn = omq.connect_remote(addr, timedelta(seconds=2))
+            assert omq.request_future(conn, 'cat.slow').get() == [b'done']
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=connect, args=(c,)) for c in clients[1:]]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(10)
+
+    assert not errors
+    assert len(allowed) == len(clients)
+    assert all(f.get() == [b'done'] for f in futures)
+
+
+def test_prepare_send(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address)
+    c1 = omq2.connect_remote(addr)
+
+    replies = []
+    echo = omq2.prepare_send('cat.echo', request=True, on_reply=lambda r: replies.append(
+        [x.tobytes() for x in r]))
+    assert echo.command == 'cat.echo'
+    assert echo.request
+
+    for i in range(5):
+        echo(c1, str(i), b'x')
+
+    timeout = datetime.now() + timedelta(seconds=1)
+    while len(replies) < 5 and datetime.now() < timeout:
+        time.sleep(0.01)
+
+    assert sorted(replies) == [[b'Hi!', str(i).encode(), b'x'] for i in range(5)]
+    assert omq2.stats()['requests_sent'] == 5
+
+    with pytest.raises(RuntimeError, match='on_reply'):
+        omq2.prepare_send('cat.echo', on_reply=lambda r: None)
+
+
+def test_pubsub(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('sub', AuthLevel.none).add_pubsub_commands(topics=['blocks'])
+
+    got = []
+    omq2.add_category('notify', AuthLevel.none).add_command(
+        'block', lambda m: got.append([bytes(x) for x in m.data()]))
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    assert omq2.request_future(c1, 'sub.subscribe', 'blocks', 'notify.block').get() == [b'OK', b'1800']
+    assert omq2.request_future(c1, 'sub.subscribe', 'txs', 'notify.block').get() == [b'UNKNOWN_TOPIC']
+    assert omq2.request_future(c1, 'sub.subscribe', 'blocks').get() == [b'BAD_REQUEST']
+    assert omq1.subscribers('blocks') == 1
+
+    assert omq1.publish('blocks', b'123', 'abc') == 1
+    assert omq1.publish('txs', b'456') == 0
+
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not got and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert got == [[b'123', b'abc']]
+
+    assert omq2.request_future(c1, 'sub.unsubscribe', 'blocks').get() == [b'OK']
+    assert omq2.request_future(c1, 'sub.unsubscribe', 'blocks').get() == [b'NOT_SUBSCRIBED']
+    assert omq1.subscribers('blocks') == 0
+    assert omq1.publish('blocks', b'789') == 0
+
+
+def test_pubsub_max_topics(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('sub', AuthLevel.none).add_pubsub_commands(max_topics=2)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    assert omq2.request_future(c1, 'sub.subscribe', 'a', 'notify.x').get()[0] == b'OK'
+    assert omq2.request_future(c1, 'sub.subscribe', 'b', 'notify.x').get()[0] == b'OK'
+    assert omq2.request_future(c1, 'sub.subscribe', 'c', 'notify.x').get() == [b'TOO_MANY_TOPICS']
+    # Renewing an existing topic is still allowed, as is a new one once a topic is freed
+    assert omq2.request_future(c1, 'sub.subscribe', 'a', 'notify.x').get()[0] == b'OK'
+    assert omq2.request_future(c1, 'sub.unsubscribe', 'b').get() == [b'OK']
+    assert omq2.request_future(c1, 'sub.subscribe', 'c', 'notify.x').get()[0] == b'OK'
+
+
+def test_reply_batch(zmq_address):
+    from oxenmq import ReplyBatch
+
+    pending = []
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('later', AuthLevel.none).add_request_command('req', lambda m: pending.append(
+        (m.later(), bytes(m.data()[0]))))
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    futures = [omq2.request_future(c1, 'later.req', str(i)) for i in range(5)]
+    timeout = datetime.now() + timedelta(seconds=1)
+    while len(pending) < 5 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert len(pending) == 5
+
+    batch = ReplyBatch()
+    for d, x in pending:
+        batch.add(d, b're', x)
+    assert len(batch) == 5
+    assert batch.flush() == 5
+    assert len(batch) == 0
+
+    assert [f.get() for f in futures] == [[b're', str(i).encode()] for i in range(5)]
+
+
+def test_parts_tuple(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('tup', AuthLevel.none).add_request_command(
+        'rev', lambda m, parts: [type(parts).__name__] + list(reversed(parts)), parts_tuple=True)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    assert omq2.request_future(c1, 'tup.rev', 'a', b'b').get() == [b'tuple', b'b', b'a']
+
+    got = None
+
+    def on_reply(parts):
+        nonlocal got
+        got = parts
+
+    omq2.request(c1, 'cat.echo', 'x', on_reply=on_reply, reply_bytes=True)
+    timeout = datetime.now() + timedelta(seconds=1)
+    while got is None and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert got == [b'Hi!', b'x']
+
+
+def test_stream(zmq_address):
+    import io
+    import threading
+
+    received = []
+    done = threading.Event()
+
+    def consume(reader):
+        for chunk in reader:
+            received.append(chunk)
+        done.set()
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('stream', AuthLevel.none) \
+        .add_stream_command('upload', lambda r: threading.Thread(target=consume, args=(r,)).start()) \
+        .add_stream_command('reject', lambda r: r.close())
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    payload = bytes(random.getrandbits(8) for _ in range(100000))
+    assert omq2.stream_send(c1, 'stream.upload', io.BytesIO(payload), chunk_size=4096, window=2) == len(payload)
+    assert done.wait(5)
+    assert all(len(c) <= 4096 for c in received)
+    assert b''.join(received) == payload
+
+    received.clear()
+    done.clear()
+    assert omq2.stream_send(c1, 'stream.upload', (b'abc' for _ in range(10)), chunk_size=2) == 30
+    assert done.wait(5)
+    assert b''.join(received) == b'abc' * 10
+
+    with pytest.raises(RuntimeError, match='closed by receiver'):
+        omq2.stream_send(c1, 'stream.reject', b'x' * 10000, chunk_size=100)
+
+
+def test_stream_bad_sequence(zmq_address):
+    readers = []
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('stream', AuthLevel.none).add_stream_command('hold', readers.append, max_window=4)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    # Chunks are sent by hand (stream id, seq, kind, data, window) to act as a broken sender.  The
+    # first chunk is buffered, unacknowledged, since nothing consumes the reader.
+    acks = []
+    omq2.request(c1, 'stream.hold', 's1', '0', 'd', 'x', '2', on_reply=acks.append, reply_bytes=True)
+    assert omq2.request_future(c1, 'stream.hold', 's1', '0', 'd', 'x', '2').get() == [b'BAD_SEQUENCE']
+    assert acks == [] and len(readers) == 1
+    # A chunk beyond the window fails the stream, which rejects the buffered chunk
+    assert omq2.request_future(c1, 'stream.hold', 's1', '2', 'd', 'x', '2').get() == [b'BAD_SEQUENCE']
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not acks and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert acks == [[b'CLOSED']]
+    with pytest.raises(RuntimeError, match='exceeded its window'):
+        next(iter(readers[0]))
+
+    assert omq2.request_future(c1, 'stream.hold', 's2', '0', 'd', 'x', '5').get() == [b'WINDOW_TOO_LARGE']
+    with pytest.raises(RuntimeError, match='max_window'):
+        omq2.stream_send(c1, 'stream.hold', b'abc', window=8)
+
+
+def test_stream_async(zmq_address):
+    import asyncio
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    loop = asyncio.new_event_loop()
+    readers = asyncio.Queue()
+    omq1.add_category('stream', AuthLevel.none).add_stream_command(
+        'upload', lambda r: loop.call_soon_threadsafe(readers.put_nowait, r))
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    async def run():
+        sent = loop.run_in_executor(None, lambda: omq2.stream_send(
+            c1, 'stream.upload', [b'x' * 1000] * 20, chunk_size=300, window=3))
+        reader = await readers.get()
+        data = b''.join([chunk async for chunk in reader])
+        return data, await sent
+
+    data, sent = loop.run_until_complete(run())
+    loop.close()
+    assert data == b'x' * 20000
+    assert sent == 20000
+
+
+def test_stream_async_sender_dies(zmq_address):
+    import asyncio
+    import threading
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    loop = asyncio.new_event_loop()
+    readers = asyncio.Queue()
+    omq1.add_category('stream', AuthLevel.none).add_stream_command(
+        'upload', lambda r: loop.call_soon_threadsafe(readers.put_nowait, r), timeout=timedelta(milliseconds=500))
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    # The sender goes silent after the first chunk, as if it had died mid-stream
+    dead = threading.Event()
+
+    def chunks():
+        yield b'x' * 100
+        dead.wait(10)
+        yield b'y' * 100
+
+    def send():
+        try:
+            omq2.stream_send(c1, 'stream.upload', chunks(), chunk_size=100)
+        except RuntimeError:
+            pass
+
+    async def run():
+        sent = loop.run_in_executor(None, send)
+        reader = await readers.get()
+        received = []
+        try:
+            with pytest.raises(RuntimeError, match='timed out'):
+                async for chunk in reader:
+                    received.append(chunk)
+        finally:
+            dead.set()
+            await sent
+        return received
+
+    assert loop.run_until_complete(asyncio.wait_for(run(), 5)) == [b'x' * 100]
+    loop.close()
+
+
+def test_request_coalescing(zmq_address):
+    calls = 0
+
+    def slow(m):
+        nonlocal calls
+        calls += 1
+        time.sleep(0.1)
+        return 'info'
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('rpc', AuthLevel.none).add_request_command('get_info', slow)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    futures = [omq2.request_future(c1, 'rpc.get_info', coalesce=True) for _ in range(5)]
+    assert [f.get() for f in futures] == [[b'info']] * 5
+    assert calls == 1
+
+    c = omq2.stats()['coalescing']
+    assert (c['misses'], c['joined'], c['hits'], c['entries']) == (1, 4, 0, 0)
+    assert omq2.stats()['requests_sent'] == 1
+
+    # Different data parts are different requests
+    omq2.request_future(c1, 'rpc.get_info', 'x', coalesce=True).get()
+    assert calls == 2
+
+    ttl = timedelta(seconds=10)
+    assert omq2.request_future(c1, 'rpc.get_info', cache_ttl=ttl).get() == [b'info']
+    assert omq2.request_future(c1, 'rpc.get_info', cache_ttl=ttl).get() == [b'info']
+    assert calls == 3
+    c = omq2.stats()['coalescing']
+    assert (c['hits'], c['entries']) == (1, 1)
+
+
+def test_remote_pool(zmq_address):
+    hits = {}
+
+    def make_server(name, reply=True):
+        omq = OxenMQ()
+        addr = Address(zmq_address + (name if name != 'a' else ''), omq.pubkey)
+        omq.listen(addr.zmq_address, curve=True)
+
+        def handler(m):
+            hits[name] = hits.get(name, 0) + 1
+            return name if reply else None
+
+        omq.add_category('rpc', AuthLevel.none).add_request_command('who', handler)
+        omq.start()
+        return omq, addr
+
+    servers = [make_server('a'), make_server('b'), make_server('dead', reply=False)]
+    client = OxenMQ()
+    client.start()
+    pool = client.remote_pool([addr for _, addr in servers], max_failures=2)
+
+    timeout = datetime.now() + timedelta(seconds=2)
+    while any(b['state'] != 'connected' for b in pool.backends) and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert [b['state'] for b in pool.backends] == ['connected'] * 3
+
+    replies = []
+    for _ in range(30):
+        try:
+            replies.append(pool.request_future('rpc.who', request_timeout=timedelta(milliseconds=50)).get())
+        except TimeoutError:
+            pass
+
+    # The dead backend gets ejected after two timeouts, after which only a and b are used
+    assert hits['dead'] == 2
+    assert hits['a'] + hits['b'] == len(replies) == 28
+    # With nothing outstanding every pick is a tie, which must alternate between a and b
+    assert abs(hits['a'] - hits['b']) <= 1
+    dead = pool.backends[2]
+    assert dead['ejected'] and dead['ejections'] == 1 and dead['failures'] == 2
+    assert all(b['outstanding'] == 0 for b in pool.backends)
+    assert pool.backends[0]['latency'] > 0
+
+    with pytest.raises(ValueError):
+        client.remote_pool([servers[0][1]], strategy='random')
+
+    import os
+    for name in ('b', 'dead'):
+        os.remove((zmq_address + name)[len('ipc://'):])
+
+
+def test_completion_queue(zmq_address):
+    import select
+    from oxenmq import CompletionQueue
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('slow', AuthLevel.none).add_request_command('never', lambda m: None)
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    q = CompletionQueue()
+    assert len(q) == 0 and q.drain() == []
+    assert select.select([q.fileno()], [], [], 0)[0] == []
+
+    for i in range(10):
+        omq2.request(c1, 'cat.echo', str(i), completion_queue=q, tag=i)
+    omq2.request(c1, 'slow.never', completion_queue=q, tag='slow',
+                 request_timeout=timedelta(milliseconds=20))
+
+    results = {}
+    timeout = datetime.now() + timedelta(seconds=2)
+    while len(results) < 11 and datetime.now() < timeout:
+        if select.select([q.fileno()], [], [], 0.1)[0]:
+            results.update(q.drain(max_n=4))
+
+    assert {i: results[i] for i in range(10)} == {i: [b'Hi!', str(i).encode()] for i in range(10)}
+    assert isinstance(results['slow'], TimeoutError)
+    assert len(q) == 0
+    assert select.select([q.fileno()], [], [], 0)[0] == []
+    assert not q.wait(timedelta(milliseconds=10))
+
+    with pytest.raises(RuntimeError, match='completion_queue'):
+        omq2.request(c1, 'cat.echo', completion_queue=q, on_reply=lambda r: None)
+
+
+def test_bt_codec():
+    value = {b'a': 1, 'b': [b'x', -2, 2**64 - 1, {b'c': b''}], b's': {b's': b'\x00' * 32}}
+    encoded = bt_encode(value)
+    assert encoded == b'd1:ai1e1:bl1:xi-2ei18446744073709551615ed1:c0:ee1:sd1:s32:' + b'\x00' * 32 + b'ee'
+    assert bt_decode(encoded) == {b'a': 1, b'b': [b'x', -2, 2**64 - 1, {b'c': b''}], b's': {b's': b'\x00' * 32}}
+    assert bt_decode(memoryview(encoded)) == bt_decode(encoded)
+    assert bt_encode(('abc', bytearray(b'de'))) == b'l3:abc2:dee'
+
+    with pytest.raises(ValueError):
+        bt_decode(b'd1:ai1e')
+    with pytest.raises(ValueError):
+        bt_decode(b'i1ei2e')
+    with pytest.raises(ValueError):
+        bt_decode(b'le1:x')
+    with pytest.raises(ValueError):
+        bt_decode(b'5:abc')
+    assert bt_decode(b'3:abc') == b'abc' and bt_decode(b'i-7e') == -7 and bt_decode(b'le') == []
+    with pytest.raises(OverflowError):
+        bt_encode(2**64)
+    with pytest.raises(ValueError):
+        bt_encode({1: 2})
+
+    # Truncated or over-long data is rejected up front
+    for bad in (encoded[:-1], encoded[:-3], encoded + b'e'):
+        with pytest.raises(ValueError):
+            BtDict(bad)
+    with pytest.raises(ValueError):
+        BtList(b'l1:x')
+
+    d = BtDict(memoryview(encoded))
+    assert len(d) == 3 and d.keys() == [b'a', b'b', b's']
+    assert d['a'] == 1 and b'b' in d and 'z' not in d
+    assert d.get(b'z', 42) == 42
+    with pytest.raises(KeyError):
+        d['z']
+    lst = d[b'b']
+    assert isinstance(lst, BtList) and len(lst) == 4
+    assert lst[0] == b'x' and lst[-2] == 2**64 - 1
+    assert isinstance(lst[3], BtDict) and lst[3].decode() == {b'c': b''}
+    assert d['s']['s'] == b'\x00' * 32
+    assert d.decode() == bt_decode(encoded)
+    assert BtList(lst.encoded).decode() == bt_decode(lst.encoded)
+    with pytest.raises(ValueError):
+        BtDict(b'l1:ae')
+
+
+def test_sn_address_table(zmq_address):
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    omq1.add_category('sn', Access(AuthLevel.none, remote_sn=True)) \
+        .add_request_command('whoami', lambda m: 'sn' if m.conn.service_node else 'nope')
+    omq1.start()
+    omq2.start()
+
+    with pytest.raises(ValueError):
+        omq2.set_sn_addresses({b'short': zmq_address})
+
+    others = {bytes([i]) * 32: 'tcp://127.0.0.1:{}'.format(5000 + i) for i in range(100)}
+    omq2.set_sn_addresses({**others, omq1.pubkey: zmq_address})
+    assert omq2.sn_address_count == 101
+    assert omq2.sn_address(omq1.pubkey) == zmq_address
+    omq2.update_sn_addresses(removed=list(others))
+    assert omq2.sn_address_count == 1
+    assert omq2.sn_address(b'\x01' * 32) is None
+
+    # No sn_lookup was given: the address comes from the table
+    assert omq2.request_future(omq1.pubkey, 'cat.echo', 'abc').get() == [b'Hi!', b'abc']
+
+    omq1.set_active_sns([b'\x01' * 32])
+    omq1.update_active_sns([omq2.pubkey], [b'\x01' * 32])
+    assert omq2.request_future(omq1.pubkey, 'sn.whoami').get() == [b'sn']
+
+
+def test_connection_authorizer(zmq_address):
+    omq1 = OxenMQ()
+    calls = []
+
+    def allow(addr, pubkey, sn):
+        calls.append(pubkey)
+        return AuthLevel.basic
+
+    auth = omq1.add_connection_authorizer(allow, deny=[b'\x01' * 32])
+    omq1.listen(zmq_address, curve=True, allow_connection=auth)
+    omq1.add_category('a', AuthLevel.basic).add_request_command('echo', echo)
+    omq1.start()
+    omq2 = OxenMQ()
+    omq2.start()
+    addr = Address(zmq_address, omq1.pubkey)
+
+    for _ in range(3):
+        c = omq2.connect_remote(addr)
+        assert omq2.request_future(c, 'a.echo', 'x').get() == [b'Hi!', b'x']
+        omq2.disconnect(c)
+
+    assert calls == [omq2.pubkey]
+    stats = auth.stats()
+    assert stats['misses'] == 1 and stats['hits'] == 2 and stats['entries'] == 1
+    auth.invalidate(pubkey=omq2.pubkey)
+    assert auth.stats()['entries'] == 0
+
+    with pytest.raises(ValueError):
+        auth.allow(b'short')
+
+
+def test_connection_authorizer_background(zmq_address):
+    omq1 = OxenMQ()
+    calls = []
+
+    def allow(addr, pubkey, sn):
+        calls.append(pubkey)
+        return AuthLevel.admin
+
+    auth = omq1.add_connection_authorizer(allow, background=True, pending_level=AuthLevel.basic)
+    assert auth.background
+    omq1.listen(zmq_address, curve=True, allow_connection=auth)
+    omq1.add_category('a', AuthLevel.basic).add_request_command('echo', echo)
+    omq1.start()
+    omq2 = OxenMQ()
+    omq2.start()
+
+    # The first connection gets the pending level while the authorizer runs in the background
+    c = omq2.connect_remote(Address(zmq_address, omq1.pubkey))
+    assert omq2.request_future(c, 'a.echo', 'x').get() == [b'Hi!', b'x']
+
+    timeout = datetime.now() + timedelta(seconds=1)
+    while auth.stats()['entries'] < 1 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert calls == [omq2.pubkey]
+    assert auth.stats()['pending'] == 0
+
+
+def test_reply_buffers(zmq_address):
+    from oxenmq import Buffer
+
+    omq1, omq2, addr = make_omqs(zmq_address)
+    c1 = omq2.connect_remote(addr)
+
+    reply = omq2.request_future(c1, 'cat.echo', 'abc', b'x' * 100000).get()
+    assert all(isinstance(r, Buffer) for r in reply)
+    assert reply == [b'Hi!', b'abc', b'x' * 100000]
+    hi = reply[0]
+    assert bytes(hi) == hi.tobytes() == b'Hi!' and len(hi) == 3
+    assert hi.decode() == 'Hi!' and hi[0] == ord('H') and hi[1:] == b'i!'
+    assert hash(hi) == hash(b'Hi!') and {b'Hi!': 1}[hi] == 1
+    assert hi != 'Hi!' and hi != b'Hi'
+    assert memoryview(hi).readonly and memoryview(hi).tobytes() == b'Hi!'
+    assert b''.join(reply[:2]) == b'Hi!abc'
+
+    # Buffers given to on_reply stay valid after the callback returns
+    kept = []
+    done = threading.Event()
+    omq2.request(c1, 'cat.echo', 'def', on_reply=lambda r: (kept.extend(r), done.set()))
+    assert done.wait(1)
+    assert kept == [b'Hi!', b'def']
+
+    kept.clear()
+    done.clear()
+    omq2.request(c1, 'cat.echo', 'ghi', reply_bytes=True, on_reply=lambda r: (kept.extend(r), done.set()))
+    assert done.wait(1)
+    assert kept == [b'Hi!', b'ghi'] and all(type(r) is bytes for r in kept)
+
+    # reply_bytes is passed through by request_future()
+    reply = omq2.request_future(c1, 'cat.echo', 'jkl', reply_bytes=True).get()
+    assert reply == [b'Hi!', b'jkl'] and all(type(r) is bytes for r in reply)
+
+
+@pytest.mark.parametrize('algorithm', ['zstd', 'lz4'])
+def test_compression(zmq_address, algorithm):
+    from oxenmq import Compression
+
+    omq1, omq2, addr = make_omqs(zmq_address, start=False)
+    dictionary = b'block snapshot state ' * 50
+    comp = Compression(algorithm, threshold=100, dictionary=dictionary)
+    received = []
+    plain = []
+    omq1.add_category('z', AuthLevel.none) \
+        .add_request_command('echo', echo, compression=comp) \
+        .add_command('sink', lambda m: received.append(m.data()), compression=comp) \
+        .add_request_command('plain', lambda m: plain.append(m.data()) or 'ok') \
+        .add_echo_request_command('mirror')
+    omq1.start()
+    omq2.start()
+    c1 = omq2.connect_remote(addr)
+
+    payload = b'block snapshot state ' * 1000
+    client_comp = Compression(algorithm, threshold=100, dictionary=dictionary)
+    assert omq2.request_future(c1, 'z.echo', payload, b'x', compression=client_comp).get() == \
+        [b'Hi!', payload, b'x']
+
+    client = omq2.stats()['compression']
+    assert client['compressed'] == 1 and client['decompressed'] == 1
+    assert client['compressed_raw_bytes'] > 20000 and client['bytes_saved'] > 15000
+    server = omq1.stats()['compression']
+    assert server['decompressed'] == 1 and server['compressed'] == 1 and server['failures'] == 0
+
+    # Small messages aren't compressed; requests without compression get uncompressed replies
+    assert omq2.request_future(c1, 'z.echo', 'small', compression=client_comp).get() == [b'Hi!', b'small']
+    assert omq2.request_future(c1, 'z.echo', payload).get() == [b'Hi!', payload]
+    assert omq2.stats()['compression']['uncompressed'] == 1
+    assert omq1.stats()['compression']['compressed'] == 1
+
+    # Plain messages are only compressed once the command is known to accept compression
+    compressed = omq2.stats()['compression']['compressed']
+    omq2.send(c1, 'z.sink', payload, compression=client_comp)
+    timeout = datetime.now() + timedelta(seconds=1)
+    while not received and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert received == [[payload]]
+    assert omq2.stats()['compression']['compressed'] == compressed
+    omq2.set_compression_supported(c1, 'z.sink')
+    omq2.send(c1, 'z.sink', payload, compression=client_comp)
+    timeout = datetime.now() + timedelta(seconds=1)
+    while len(received) < 2 and datetime.now() < timeout:
+        time.sleep(0.01)
+    assert received == [[payload]] * 2
+    assert omq2.stats()['compression']['compressed'] == compressed + 1
+
+    # A mismatched dictionary is rejected with an error reply, after which the sender falls back to
+    # sending that command uncompressed
+    other = Compression(algorithm, threshold=100, dictionary=b'something else entirely' * 10)
+    with pytest.raises(RuntimeError, match='COMPRESSION_ERROR'):
+        omq2.request_future(c1, 'z.echo', payload, compression=other).get()
+    assert omq1.stats()['compression']['failures'] == 1
+    assert omq2.stats()['compression']['rejected'] == 1
+    compressed = omq2.stats()['compression']['compressed']
+    assert omq2.request_future(c1, 'z.echo', payload, compression=other).get() == [b'Hi!', payload]
+    assert omq2.stats()['compression']['compressed'] == compressed
+
+    # A command that doesn't accept compression never sees the compressed envelope
+    with pytest.raises(RuntimeError, match='COMPRESSION_ERROR'):
+        omq2.request_future(c1, 'z.plain', payload, compression=client_comp).get()
+    assert plain == []
+    assert omq2.request_future(c1, 'z.plain', payload, compression=client_comp).get() == [b'ok']
+    assert plain == [[payload]]
+    assert omq1.stats()['compression']['failures'] == 2
+
+    # Nor do the natively handled commands
+    with pytest.raises(RuntimeError, match='COMPRESSION_ERROR'):
+        omq2.request_future(c1, 'z.mirror', payload, compression=client_comp).get()
+    assert omq2.request_future(c1, 'z.mirror', payload, compression=client_comp).get() == [payload]
+    assert omq1.stats()['compression']['failures'] == 3
+
+    with pytest.raises(ValueError):
+        Compression('gzip')